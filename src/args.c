@@ -198,7 +198,7 @@ strm_parse_args(strm_stream* strm, int argc, strm_value* argv, const char* forma
     case 'b':
       {
         strm_int* p;
-        strm_int bb;
+        strm_value bb;
 
         p = va_arg(ap, strm_int*);
         if (i < argc) {
@@ -0,0 +1,313 @@
+#include "strm.h"
+#include "queue.h"
+#include "atomic.h"
+#include <pthread.h>
+
+/* default number of messages kept in a channel; subscribers that
+   fall behind more than this lose messages (or get disconnected) */
+#ifndef STRM_CHAN_SIZE
+#define STRM_CHAN_SIZE 4096
+#endif
+
+/* max number of messages delivered to a subscriber per task */
+#ifndef STRM_CHAN_BATCH
+#define STRM_CHAN_BATCH 256
+#endif
+
+struct chan_slot {
+  uint64_t seq;
+  strm_value v;
+};
+
+struct chan_sub {
+  struct chan_data* c;
+  strm_stream* dst;
+  uint64_t cursor;              /* sequence of the next message */
+  strm_int sched;               /* delivery task is queued */
+  strm_int flags;               /* SUB_IDLE, SUB_DEAD */
+  struct chan_sub* next;        /* in idle list */
+};
+
+#define SUB_IDLE 1              /* in the idle list */
+#define SUB_DEAD 2              /* destination closed */
+
+/* a channel is a ring buffer shared by all subscribers; each message
+   is stored once, and each subscriber reads it at its own pace.
+   subscribers that have caught up wait in the idle list, so a burst
+   wakes only them, and the lock is held just to take the list */
+struct chan_data {
+  uint64_t head;                /* sequence of the next message */
+  uint64_t mask;
+  int disconnect;
+  struct chan_slot* ring;
+  pthread_mutex_t lock;
+  struct chan_sub* idle;
+  int flush;                    /* chan_flush() is queued */
+};
+
+#define SEQ_BUSY UINT64_MAX
+
+static int chan_push(strm_stream* strm, strm_value data);
+
+int
+strm_chan_p(strm_stream* strm)
+{
+  return strm->start_func == chan_push;
+}
+
+/* read message at seq; fails if it has been overwritten */
+static int
+chan_read(struct chan_data* c, uint64_t seq, strm_value* v)
+{
+  struct chan_slot* slot = &c->ring[seq & c->mask];
+
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) return FALSE;
+  *v = __atomic_load_n(&slot->v, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static int
+sub_closed_p(struct chan_sub* s)
+{
+  strm_stream_mode mode = __atomic_load_n(&s->dst->mode, __ATOMIC_ACQUIRE);
+
+  return mode == strm_dying || mode == strm_killed;
+}
+
+/* wait in the idle list (unless already there) for chan_wake() */
+static void
+chan_idle(struct chan_sub* s)
+{
+  struct chan_data* c = s->c;
+
+  if (__atomic_fetch_or(&s->flags, SUB_IDLE, __ATOMIC_SEQ_CST) & SUB_IDLE)
+    return;
+  pthread_mutex_lock(&c->lock);
+  s->next = c->idle;
+  c->idle = s;
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* drop a subscriber whose destination is closed; if it is still in
+   the idle list, chan_wake() frees it */
+static void
+chan_unsub(struct chan_sub* s)
+{
+  if (__atomic_load_n(&s->dst->mode, __ATOMIC_ACQUIRE) == strm_dying) {
+    /* drop the reference taken by strm_chan_subscribe() */
+    strm_stream_close(s->dst);
+  }
+  if ((__atomic_fetch_or(&s->flags, SUB_DEAD, __ATOMIC_SEQ_CST) & SUB_IDLE) == 0) {
+    free(s);
+  }
+}
+
+static int
+chan_drain(strm_stream* strm, strm_value data)
+{
+  struct chan_sub* s = strm_value_foreign(data);
+  struct chan_data* c = s->c;
+  strm_value vals[STRM_CHAN_BATCH];
+  uint64_t head;
+  strm_int i, n;
+
+  for (;;) {
+    if (sub_closed_p(s)) {
+      chan_unsub(s);
+      return STRM_OK;
+    }
+    head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    if (s->cursor == head) {
+      /* no more messages; chan_wake() will schedule us again */
+      __atomic_store_n(&s->sched, 0, __ATOMIC_SEQ_CST);
+      chan_idle(s);
+      if (__atomic_load_n(&c->head, __ATOMIC_SEQ_CST) == s->cursor ||
+          !strm_atomic_cas(s->sched, 0, 1))
+        return STRM_OK;
+      continue;
+    }
+    n = 0;
+    while (n < STRM_CHAN_BATCH && s->cursor+n < head) {
+      if (!chan_read(c, s->cursor+n, &vals[n])) break;
+      n++;
+    }
+    if (n == 0) {
+      /* lagged behind the ring */
+      if (c->disconnect) {
+        strm->mode = strm_dying;
+        chan_unsub(s);
+        return STRM_OK;
+      }
+      head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+      s->cursor = head - (c->mask+1)/2;
+      continue;
+    }
+    s->cursor += n;
+    break;
+  }
+
+  /* queue the last message as an ordinary task, so that the
+     destination sees the rest of the batch as a single burst */
+  if (n > 1) {
+    strm_task_push(strm, strm->start_func, vals[n-1]);
+    n--;
+  }
+  for (i=0; i<n; i++) {
+    (*strm->start_func)(strm, vals[i]);
+    if (sub_closed_p(s)) {
+      chan_unsub(s);
+      return STRM_OK;
+    }
+  }
+  __atomic_store_n(&s->sched, 0, __ATOMIC_SEQ_CST);
+  chan_idle(s);
+  if (__atomic_load_n(&c->head, __ATOMIC_SEQ_CST) != s->cursor &&
+      strm_atomic_cas(s->sched, 0, 1)) {
+    strm_task_push(strm, chan_drain, data);
+  }
+  return STRM_OK;
+}
+
+/* schedule delivery to idle subscribers; frees closed ones */
+static void
+chan_wake(struct chan_data* c)
+{
+  struct chan_sub *s, *next;
+
+  pthread_mutex_lock(&c->lock);
+  s = c->idle;
+  c->idle = NULL;
+  pthread_mutex_unlock(&c->lock);
+
+  for (; s; s = next) {
+    next = s->next;
+    if (__atomic_load_n(&s->sched, __ATOMIC_SEQ_CST) == 0 &&
+        strm_atomic_cas(s->sched, 0, 1)) {
+      /* no drain runs; we own the subscriber */
+      __atomic_fetch_and(&s->flags, ~SUB_IDLE, __ATOMIC_SEQ_CST);
+      if (sub_closed_p(s)) {
+        chan_unsub(s);
+      }
+      else {
+        strm_task_push(s->dst, chan_drain, strm_foreign_value(s));
+      }
+    }
+    else if (__atomic_fetch_and(&s->flags, ~SUB_IDLE, __ATOMIC_SEQ_CST) & SUB_DEAD) {
+      /* unsubscribed by its drain while in the list */
+      free(s);
+    }
+  }
+}
+
+static int
+chan_flush(strm_stream* strm, strm_value data)
+{
+  struct chan_data* c = strm->data;
+
+  c->flush = FALSE;
+  chan_wake(c);
+  return STRM_OK;
+}
+
+static int
+chan_push(strm_stream* strm, strm_value data)
+{
+  struct chan_data* c = strm->data;
+  uint64_t seq = c->head;
+  struct chan_slot* slot = &c->ring[seq & c->mask];
+
+  __atomic_store_n(&slot->seq, SEQ_BUSY, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&slot->v, data, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&c->head, seq+1, __ATOMIC_SEQ_CST);
+
+  /* wake subscribers at the end of each burst */
+  if (strm_queue_empty_p(strm->queue)) {
+    chan_wake(c);
+  }
+  else if (!c->flush) {
+    /* the burst may end with another task, e.g. a publisher closing */
+    c->flush = TRUE;
+    strm_task_push(strm, chan_flush, strm_nil_value());
+  }
+  return STRM_OK;
+}
+
+/* subscribers receive messages sent after they subscribed */
+void
+strm_chan_subscribe(strm_stream* chan, strm_stream* dst)
+{
+  struct chan_data* c = chan->data;
+  struct chan_sub* s = malloc(sizeof(struct chan_sub));
+
+  s->c = c;
+  s->dst = dst;
+  s->sched = 0;
+  s->flags = 0;
+  strm_atomic_inc(dst->refcnt);
+  s->cursor = __atomic_load_n(&c->head, __ATOMIC_SEQ_CST);
+  chan_idle(s);
+  /* a message may have been sent before we joined the idle list */
+  if (__atomic_load_n(&c->head, __ATOMIC_SEQ_CST) != s->cursor &&
+      strm_atomic_cas(s->sched, 0, 1)) {
+    strm_task_push(dst, chan_drain, strm_foreign_value(s));
+  }
+}
+
+/* chan([size[, disconnect]]): broadcast channel;
+   stream data into it, and connect it to subscribers:
+
+     ch = chan()
+     ch | s      # subscribe
+     s | ch      # broadcast
+
+   a subscriber more than `size` messages behind skips to the recent
+   half of the buffer, or gets closed if `disconnect` is true */
+static int
+exec_chan(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  strm_int size = STRM_CHAN_SIZE;
+  strm_int n = 2;
+  int disconnect = FALSE;
+  struct chan_data* c;
+  strm_stream* t;
+  strm_int i;
+
+  strm_get_args(strm, argc, args, "|ib", &size, &disconnect);
+  if (size <= 0) {
+    strm_raise(strm, "channel size should be positive");
+    return STRM_NG;
+  }
+  while (n < size) n *= 2;
+  c = malloc(sizeof(struct chan_data));
+  c->ring = malloc(sizeof(struct chan_slot)*n);
+  if (!c->ring) {
+    free(c);
+    strm_raise(strm, "channel too large");
+    return STRM_NG;
+  }
+  for (i=0; i<n; i++) {
+    c->ring[i].seq = SEQ_BUSY;
+  }
+  c->head = 0;
+  c->mask = n-1;
+  c->disconnect = disconnect;
+  pthread_mutex_init(&c->lock, NULL);
+  c->idle = NULL;
+  c->flush = FALSE;
+  t = strm_stream_new(strm_filter, chan_push, NULL, (void*)c);
+  /* publishers come and go; the channel lives on, but alone it does
+     not keep the program running */
+  t->refcnt = 1;
+  strm_stream_detach(t);
+  *ret = strm_stream_value(t);
+  return STRM_OK;
+}
+
+void
+strm_chan_init(strm_state* state)
+{
+  strm_var_def(state, "chan", strm_cfunc_value(exec_chan));
+}
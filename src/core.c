@@ -11,6 +11,11 @@ struct strm_worker {
 static struct strm_queue* queue;
 static struct strm_queue* prod_queue;
 static int worker_max;
+
+/* workers need enough stack for STRM_CALL_DEPTH_MAX nested calls */
+#ifndef STRM_WORKER_STACK_SIZE
+#define STRM_WORKER_STACK_SIZE (8*1024*1024)
+#endif
 static int stream_count = 0;
 
 /* internal variable to tell multi-threaded mode */
@@ -18,6 +23,7 @@ int strm_event_loop_started = FALSE;
 
 #include <assert.h>
 
+static void queue_init();
 static void task_init();
 
 struct strm_task*
@@ -32,10 +38,9 @@ strm_task_new(strm_callback func, strm_value data)
   return t;
 }
 
-void
-strm_task_add(strm_stream* strm, struct strm_task* task)
+static void
+stream_enqueue(strm_stream* strm)
 {
-  strm_queue_add(strm->queue, task);
   if (strm->mode == strm_producer) {
     strm_queue_add(prod_queue, strm);
   }
@@ -44,6 +49,13 @@ strm_task_add(strm_stream* strm, struct strm_task* task)
   }
 }
 
+void
+strm_task_add(strm_stream* strm, struct strm_task* task)
+{
+  strm_queue_add(strm->queue, task);
+  stream_enqueue(strm);
+}
+
 void
 strm_task_push(strm_stream* strm, strm_callback func, strm_value data)
 {
@@ -90,8 +102,9 @@ strm_emit(strm_stream* strm, strm_value data, strm_callback func)
       }
     }
   }
-  sched_yield();
   if (func) {
+    /* let consumers run before the producer continues */
+    sched_yield();
     strm_task_push(strm, func, strm_nil_value());
   }
 }
@@ -114,7 +127,7 @@ strm_stream_connect(strm_stream* src, strm_stream* dst)
   strm_atomic_inc(dst->refcnt);
 
   if (src->mode == strm_producer) {
-    task_init();
+    queue_init();
     strm_task_push(src, src->start_func, strm_nil_value());
   }
   return STRM_OK;
@@ -124,8 +137,8 @@ int cpu_count();
 void strm_init_io_loop();
 strm_stream* strm_io_deque();
 
-static int
-worker_count()
+int
+strm_worker_count()
 {
   char *e = getenv("STRM_WORKER_MAX");
   int n;
@@ -155,6 +168,15 @@ task_exec(strm_stream* strm, struct strm_task* task)
   }
 }
 
+/* tasks a producer runs per pick; with one task, consumers drain
+   (and flush output) after every record of a producer like seq(),
+   while an unbounded batch lets a producer queue its whole input
+   ahead of its consumers.  a reader task emits up to STRM_READ_BATCH
+   lines, so it runs at most a few thousand lines ahead */
+#ifndef PRODUCER_BATCH
+#define PRODUCER_BATCH 32
+#endif
+
 static void*
 task_loop(void *data)
 {
@@ -169,36 +191,73 @@ task_loop(void *data)
       if (strm_atomic_cas(strm->excl, 0, 1)) {
         struct strm_task* t;
 
-        while ((t = strm_queue_get(strm->queue)) != NULL) {
-          task_exec(strm, t);
+        if (strm->mode == strm_producer) {
+          int i;
+
+          /* run a limited number of tasks at a time, so that a producer
+             does not run far ahead of its consumers */
+          for (i=0; i<PRODUCER_BATCH; i++) {
+            if ((t = strm_queue_get(strm->queue)) == NULL) break;
+            task_exec(strm, t);
+          }
+        }
+        else {
+          while ((t = strm_queue_get(strm->queue)) != NULL) {
+            task_exec(strm, t);
+          }
         }
         strm_atomic_cas(strm->excl, 1, 0);
+        /* tasks left by the batch, or added while we held the stream,
+           may have lost their queue entries to a failed CAS */
+        if (!strm_queue_empty_p(strm->queue)) {
+          stream_enqueue(strm);
+        }
+        continue;
       }
+      /* run by another worker; keep the entry for its later tasks */
+      stream_enqueue(strm);
     }
     if (stream_count == 0) {
       break;
     }
+    /* no runnable stream (or it is run by another worker); give the
+       CPU to busy workers, which matters when workers outnumber CPUs */
+    sched_yield();
   }
   return NULL;
 }
 
+static void
+queue_init()
+{
+  if (queue) return;
+
+  strm_init_io_loop();
+  queue = strm_queue_new();
+  prod_queue = strm_queue_new();
+}
+
+/* workers start after the program has built its pipelines; a producer
+   started by strm_stream_connect() could otherwise finish (and close
+   the stages connected so far) before the rest is connected */
 static void
 task_init()
 {
   int i;
+  pthread_attr_t attr;
 
   if (workers) return;
 
+  queue_init();
   strm_event_loop_started = TRUE;
-  strm_init_io_loop();
-
-  queue = strm_queue_new();
-  prod_queue = strm_queue_new();
-  worker_max = worker_count();
+  worker_max = strm_worker_count();
   workers = malloc(sizeof(struct strm_worker)*worker_max);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, STRM_WORKER_STACK_SIZE);
   for (i=0; i<worker_max; i++) {
-    pthread_create(&workers[i].th, NULL, task_loop, &workers[i]);
+    pthread_create(&workers[i].th, &attr, task_loop, &workers[i]);
   }
+  pthread_attr_destroy(&attr);
 }
 
 int
@@ -238,6 +297,14 @@ strm_stream_new(strm_stream_mode mode, strm_callback start_func, strm_callback c
   return s;
 }
 
+/* the stream no longer keeps the program running; for streams that
+   are never closed, e.g. channels */
+void
+strm_stream_detach(strm_stream* strm)
+{
+  strm_atomic_dec(stream_count);
+}
+
 void
 strm_stream_close(strm_stream* strm)
 {
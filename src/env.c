@@ -115,3 +115,11 @@ strm_env_copy(strm_state* s1, strm_state* s2)
   }
   return STRM_OK;
 }
+
+void
+strm_env_clear(strm_state* state)
+{
+  if (state->env) {
+    kh_clear(env, (strm_env*)state->env);
+  }
+}
@@ -5,6 +5,23 @@
 #define NODE_ERROR_RETURN 1
 #define NODE_ERROR_SKIP 2
 
+/* exec_tail() result: a call in tail position is left to the caller */
+#define STRM_TAILCALL 2
+
+/* maximum nesting level of lambda calls */
+#ifndef STRM_CALL_DEPTH_MAX
+#define STRM_CALL_DEPTH_MAX 2048
+#endif
+
+static __thread int call_depth = 0;
+
+struct tailcall {
+  strm_value func;
+  int argc;
+  strm_value* argv;
+  int capa;
+};
+
 static void
 strm_clear_exc(strm_stream* strm)
 {
@@ -118,6 +135,11 @@ strm_connect(strm_stream* strm, strm_value src, strm_value dst, strm_value* ret)
       strm_raise(strm, "stream error");
       return STRM_NG;
     }
+    if (strm_chan_p(lstrm)) {
+      strm_chan_subscribe(lstrm, rstrm);
+      *ret = dst;
+      return STRM_OK;
+    }
     strm_stream_connect(strm_value_stream(src), strm_value_stream(dst));
     *ret = dst;
     return STRM_OK;
@@ -134,7 +156,10 @@ exec_bar(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return strm_connect(strm, x, y, ret);
 }
 
-static int exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val);
+/* tc: deferred call of the running lambda (NULL outside of lambda body) */
+/* tail: np is in tail position */
+static int exec_tail(strm_stream* strm, strm_state* state, node* np, strm_value* val, struct tailcall* tc, int tail);
+#define exec_expr(strm,state,np,val) exec_tail(strm,state,np,val,NULL,FALSE)
 
 static int
 ary_get(strm_stream* strm, strm_value ary, int argc, strm_value* argv, strm_value* ret)
@@ -369,80 +394,127 @@ pattern_match(strm_stream* strm, strm_state* state, node* npat, int argc, strm_v
   return STRM_OK;
 }
 
+/* defer a call to the trampoline in lambda_call() */
+static int
+tail_call(struct tailcall* tc, strm_value func, int argc, strm_value* argv)
+{
+  if (argc > tc->capa) {
+    tc->capa = argc;
+    tc->argv = realloc(tc->argv, sizeof(strm_value)*argc);
+  }
+  memcpy(tc->argv, argv, sizeof(strm_value)*argc);
+  tc->func = func;
+  tc->argc = argc;
+  return STRM_TAILCALL;
+}
+
+/* reuse the environment unless closures refer to it */
+static void
+env_reset(strm_state* c)
+{
+  if (c->flags & STRM_STATE_CAPTURED) {
+    c->env = NULL;
+    c->flags &= ~STRM_STATE_CAPTURED;
+  }
+  else {
+    strm_env_clear(c);
+  }
+}
+
 static int
 lambda_call(strm_stream* strm, strm_value func, int argc, strm_value* argv, strm_value* ret)
 {
-  struct strm_lambda* lambda = strm_value_lambda(func);
+  struct strm_lambda* lambda;
+  struct tailcall tc = {0};
   strm_state c = {0};
   int i, n;
   node_error* exc;
 
-  c.prev = lambda->state;
-  if (lambda->body->type == NODE_LAMBDA) {
-    node_lambda* nlmbd = (node_lambda*)lambda->body;
-    node_args* args = (node_args*)nlmbd->args;
-
-    if (args == NULL) {
-      if (argc > 0) goto argerr;
-    }
-    else if (args->len != argc) {
-    argerr:
-      strm_raise(strm, "wrong number of arguments");
-      goto err;
-    }
-    for (i=0; i<argc; i++) {
-      n = strm_var_set(&c, node_to_sym(args->data[i]), argv[i]);
-      if (n) return n;
-    }
-    n = exec_expr(strm, &c, nlmbd->body, ret);
+  if (call_depth >= STRM_CALL_DEPTH_MAX) {
+    strm_raise(strm, "stack level too deep");
+    return STRM_NG;
   }
-  else if (lambda->body->type == NODE_PLAMBDA) {
-    node_plambda* plmbd = (node_plambda*)lambda->body;
-    int nexec = 0;
-
-    while (plmbd) {
-      if (pattern_match(strm, &c, plmbd->pat, argc, argv) == STRM_OK) {
-        strm_value cond;
+  call_depth++;
+  for (;;) {
+    lambda = strm_value_lambda(func);
+    c.prev = lambda->state;
+    if (lambda->body->type == NODE_LAMBDA) {
+      node_lambda* nlmbd = (node_lambda*)lambda->body;
+      node_args* args = (node_args*)nlmbd->args;
 
-        if (plmbd->cond) {
-          n = exec_expr(strm, &c, plmbd->cond, &cond);
-          if (n == STRM_OK && strm_value_bool(cond)) {
+      if (args == NULL) {
+        if (argc > 0) goto argerr;
+      }
+      else if (args->len != argc) {
+      argerr:
+        strm_raise(strm, "wrong number of arguments");
+        goto err;
+      }
+      for (i=0; i<argc; i++) {
+        n = strm_var_set(&c, node_to_sym(args->data[i]), argv[i]);
+        if (n) goto done;
+      }
+      n = exec_tail(strm, &c, nlmbd->body, ret, &tc, TRUE);
+    }
+    else if (lambda->body->type == NODE_PLAMBDA) {
+      node_plambda* plmbd = (node_plambda*)lambda->body;
+      int nexec = 0;
+
+      while (plmbd) {
+        if (pattern_match(strm, &c, plmbd->pat, argc, argv) == STRM_OK) {
+          strm_value cond;
+
+          if (plmbd->cond) {
+            n = exec_expr(strm, &c, plmbd->cond, &cond);
+            if (n == STRM_OK && strm_value_bool(cond)) {
+              nexec++;
+              n = exec_tail(strm, &c, plmbd->body, ret, &tc, TRUE);
+              break;
+            }
+          }
+          else {
             nexec++;
-            n = exec_expr(strm, &c, plmbd->body, ret);
+            n = exec_tail(strm, &c, plmbd->body, ret, &tc, TRUE);
             break;
           }
         }
-        else {
-          nexec++;
-          n = exec_expr(strm, &c, plmbd->body, ret);
-          break;
-        }
+        env_reset(&c);
+        plmbd = (node_plambda*)plmbd->next;
+      }
+      if (nexec == 0) {
+        strm_raise(strm, "match failure");
+        goto err;
       }
-      c.env = NULL;
-      plmbd = (node_plambda*)plmbd->next;
     }
-    if (nexec == 0) {
-      strm_raise(strm, "match failure");
-      goto err;
+    else {
+      n = STRM_NG;
+      goto done;
     }
-  }
-  else {
-    return STRM_NG;
+    if (n != STRM_TAILCALL) break;
+    /* tail call: loop instead of recursion */
+    func = tc.func;
+    argc = tc.argc;
+    argv = tc.argv;
+    env_reset(&c);
   }
   if (n == STRM_NG && strm) {
     exc = strm->exc;
     if (exc && exc->type == NODE_ERROR_RETURN) {
       *ret = exc->arg;
-      return STRM_OK;
+      n = STRM_OK;
     }
   }
-  return n;
+  goto done;
  err:
   if (strm && strm->exc) {
     strm->exc->fname = lambda->body->fname;
     strm->exc->lineno = lambda->body->lineno;
   }
-  return STRM_NG;
+  n = STRM_NG;
+ done:
+  call_depth--;
+  free(tc.argv);
+  return n;
 }
 
 static struct strm_genfunc*
@@ -457,7 +529,7 @@ genfunc_new(strm_state* state, strm_string id)
   return gf;
 }
 
-static int exec_call(strm_stream* strm, strm_state* state, strm_string name, int argc, strm_value* argv, strm_value* ret);
+static int exec_call(strm_stream* strm, strm_state* state, strm_string name, int argc, strm_value* argv, strm_value* ret, struct tailcall* tc);
 
 int
 strm_funcall(strm_stream* strm, strm_value func, int argc, strm_value* argv, strm_value* ret)
@@ -470,7 +542,7 @@ strm_funcall(strm_stream* strm, strm_value func, int argc, strm_value* argv, str
   case STRM_TAG_PTR:
     if (strm_ptr_tag_p(func, STRM_PTR_GENFUNC)) {
       struct strm_genfunc *gf = strm_value_vptr(func);
-      return exec_call(strm, gf->state, gf->id, argc, argv, ret);
+      return exec_call(strm, gf->state, gf->id, argc, argv, ret, NULL);
     }
     else if (strm_lambda_p(func)) {
       return lambda_call(strm, func, argc, argv, ret);
@@ -484,7 +556,7 @@ strm_funcall(strm_stream* strm, strm_value func, int argc, strm_value* argv, str
 }
 
 static int
-exec_call(strm_stream* strm, strm_state* state, strm_string name, int argc, strm_value* argv, strm_value* ret)
+exec_call(strm_stream* strm, strm_state* state, strm_string name, int argc, strm_value* argv, strm_value* ret, struct tailcall* tc)
 {
   int n = STRM_NG;
   strm_value m;
@@ -507,6 +579,9 @@ exec_call(strm_stream* strm, strm_state* state, strm_string name, int argc, strm
     n = strm_var_get(state, name, &m);
   }
   if (n == STRM_OK) {
+    if (tc && strm_lambda_p(m)) {
+      return tail_call(tc, m, argc, argv);
+    }
     return strm_funcall(strm, m, argc, argv, ret);
   }
   strm_raise(strm, "function not found");
@@ -527,7 +602,7 @@ ary_headers(node_string* headers, strm_int len)
 }
 
 static int
-exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
+exec_tail(strm_stream* strm, strm_state* state, node* np, strm_value* val, struct tailcall* tc, int tail)
 {
   int n;
 
@@ -556,6 +631,7 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
         return STRM_NG;
       }
       STRM_NS_UDEF_SET(s);
+      state->flags |= STRM_STATE_CAPTURED;
       if (ns->body)
         return exec_expr(strm, s, ns->body, val);
       return STRM_OK;
@@ -699,10 +775,10 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
       n = exec_expr(strm, state, nif->cond, &v);
       if (n) return n;
       if (strm_bool_p(v) && strm_value_bool(v)) {
-        return exec_expr(strm, state, nif->then, val);
+        return exec_tail(strm, state, nif->then, val, tc, tail);
       }
       else if (nif->opt_else != NULL) {
-        return exec_expr(strm, state, nif->opt_else, val);
+        return exec_tail(strm, state, nif->opt_else, val, tc, tail);
       }
       else {
         *val = strm_nil_value();
@@ -724,7 +800,7 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
         n = exec_expr(strm, state, nop->rhs, &args[i++]);
         if (n) return n;
       }
-      return exec_call(strm, state, node_to_sym(nop->op), i, args, val);
+      return exec_call(strm, state, node_to_sym(nop->op), i, args, val, tail ? tc : NULL);
     }
     break;
   case NODE_LAMBDA:
@@ -736,6 +812,7 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
       lambda->state = malloc(sizeof(strm_state));
       if (!lambda->state) return STRM_NG;
       *lambda->state = *state;
+      state->flags |= STRM_STATE_CAPTURED;
       lambda->type = STRM_PTR_LAMBDA;
       lambda->body = (node_lambda*)np;
       *val = strm_ptr_value(lambda);
@@ -773,7 +850,7 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
           }
         }
       }
-      n = exec_call(strm, state, node_to_sym(ncall->ident), i, args, val);
+      n = exec_call(strm, state, node_to_sym(ncall->ident), i, args, val, tail ? tc : NULL);
       if (!splat) free(args);
       return n;
     }
@@ -812,7 +889,12 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
           }
         }
       }
-      n = strm_funcall(strm, func, i, args, val);
+      if (tail && tc && strm_lambda_p(func)) {
+        n = tail_call(tc, func, i, args);
+      }
+      else {
+        n = strm_funcall(strm, func, i, args, val);
+      }
       if (!splat) free(args);
       return n;
     }
@@ -824,6 +906,7 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
 
       gf = genfunc_new(state, node_to_str(ngf->id));
       if (!gf) return STRM_NG;
+      state->flags |= STRM_STATE_CAPTURED;
       *val = strm_ptr_value(gf);
       return STRM_OK;
     }
@@ -843,7 +926,8 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
           arg = strm_nil_value();
           break;
         case 1:
-          n = exec_expr(strm, state, args->data[0], &arg);
+          /* return value is always in tail position */
+          n = exec_tail(strm, state, args->data[0], &arg, tc, TRUE);
           if (n) return n;
           break;
         default:
@@ -869,7 +953,8 @@ exec_expr(strm_stream* strm, strm_state* state, node* np, strm_value* val)
       int i;
       node_nodes* v = (node_nodes*)np;
       for (i = 0; i < v->len; i++) {
-        n = exec_expr(strm, state, v->data[i], val);
+        n = exec_tail(strm, state, v->data[i], val, tc, tail && i == v->len-1);
+        if (n == STRM_TAILCALL) return n;
         if (n) {
           if (strm) {
             node_error* exc = strm->exc;
@@ -964,13 +1049,30 @@ exec_fread(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   int fd;
   strm_string path;
   char buf[7];
-
-  strm_get_args(strm, argc, args, "S", &path);
-  fd = open(strm_str_cstr(path, buf), O_RDONLY);
+  const char* p;
+  strm_int n = 1;
+  strm_int ordered = FALSE;
+
+  strm_get_args(strm, argc, args, "S|ib", &path, &n, &ordered);
+  p = strm_str_cstr(path, buf);
+  if (!p) {
+    strm_raise(strm, "out of memory");
+    return STRM_NG;
+  }
+  fd = open(p, O_RDONLY);
   if (fd < 0) {
     strm_raise(strm, "fread() failed");
     return STRM_NG;
   }
+  /* fread(path, n[, ordered]): read a large file by n producers */
+  if (n > 1) {
+    strm_stream* s = strm_readio_parallel(fd, n, ordered);
+
+    if (s) {
+      *ret = strm_stream_value(s);
+      return STRM_OK;
+    }
+  }
   *ret = strm_io_new(fd, STRM_IO_READ);
   return STRM_OK;
 }
@@ -981,9 +1083,15 @@ exec_fwrite(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   int fd;
   strm_string path;
   char buf[7];
+  const char* p;
 
   strm_get_args(strm, argc, args, "S", &path);
-  fd = open(strm_str_cstr(path, buf), O_WRONLY|O_CREAT, 0644);
+  p = strm_str_cstr(path, buf);
+  if (!p) {
+    strm_raise(strm, "out of memory");
+    return STRM_NG;
+  }
+  fd = open(p, O_WRONLY|O_CREAT, 0644);
   if (fd < 0) return STRM_NG;
   *ret = strm_io_new(fd, STRM_IO_WRITE);
   return STRM_OK;
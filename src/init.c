@@ -14,6 +14,9 @@ void strm_kvs_init(strm_state* state);
 void strm_time_init(strm_state* state);
 void strm_math_init(strm_state* state);
 void strm_graph_init(strm_state* state);
+void strm_sketch_init(strm_state* state);
+void strm_chan_init(strm_state* state);
+void strm_parallel_init(strm_state* state);
 
 void
 strm_init(strm_state* state)
@@ -32,4 +35,7 @@ strm_init(strm_state* state)
   strm_time_init(state);
   strm_math_init(state);
   strm_graph_init(state);
+  strm_sketch_init(state);
+  strm_chan_init(state);
+  strm_parallel_init(state);
 }
@@ -5,14 +5,16 @@
 #ifndef _WIN32
 # include <sys/uio.h>
 # include <sys/socket.h>
+# include <poll.h>
 #else
 # include <ws2tcpip.h>
 #endif
 #include <sys/stat.h>
+#include <fcntl.h>
+#include "queue.h"
+#include "atomic.h"
 
-static pthread_t io_worker;
 static int io_wait_num = 0;
-static int epoll_fd;
 
 #define STRM_IO_NOWAIT 1
 #define STRM_IO_NOFILL 2
@@ -27,7 +29,46 @@ static int epoll_fd;
 #include <sys/mman.h>
 #endif
 
-#define MAX_EVENTS 10
+/* number of events taken by one epoll_wait(2) */
+#ifndef STRM_IO_EVENTS
+#define STRM_IO_EVENTS 256
+#endif
+
+/* upper limit of I/O threads; fds are sharded over the threads,
+   each with its own epoll instance (or io_uring) */
+#ifndef STRM_IO_THREADS
+#define STRM_IO_THREADS 16
+#endif
+
+static int io_nthreads = 1;
+static int epoll_fds[STRM_IO_THREADS];
+#define io_epoll_fd(strm,fd) epoll_fds[io_shard(strm,fd)]
+
+/* a stream pinned by strm_io_set_thread() keeps its I/O thread (plus
+   one) in the upper bits of flags */
+#define STRM_IO_THREAD_SHIFT 8
+
+static int
+io_shard(strm_stream* strm, int fd)
+{
+  unsigned int t = strm->flags >> STRM_IO_THREAD_SHIFT;
+
+  if (t > 0) return (t-1) % io_nthreads;
+  return fd % io_nthreads;
+}
+
+/* io_uring backend on Linux; falls back to epoll if io_uring is not
+   available at runtime, or disabled by STRM_IO_URING=0 */
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#  include <sys/mman.h>
+#  ifdef IORING_FEAT_FAST_POLL
+#   define STRM_IO_URING
+#  endif
+# endif
+#endif
 
 #ifdef _WIN32
 ssize_t
@@ -55,14 +96,165 @@ io_task_add(struct strm_task* task)
   strm_task_add(strm, task);
 }
 
+#ifdef STRM_IO_URING
+#define URING_ENTRIES 256
+/* tag in user_data: the completion carries the result of read(2) */
+#define URING_READ 1
+
+static int use_uring = FALSE;
+
+/* one ring per I/O thread; the lock serializes submissions from
+   workers, and only the thread of the ring reaps completions */
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  pthread_mutex_t lock;
+};
+
+static struct uring rings[STRM_IO_THREADS];
+#define io_ring(strm,fd) (&rings[io_shard(strm,fd)])
+
+static int
+uring_enter(struct uring* ring, unsigned submit, unsigned wait, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, NULL, 0);
+}
+
+static int
+uring_init(struct uring* ring)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+  size_t sqsz, cqsz;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (ring->fd < 0) return -1;
+  /* reads on sockets and pipes should not block kernel workers */
+  if ((p.features & IORING_FEAT_FAST_POLL) == 0) goto fail;
+
+  sqsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  cqsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cqsz > sqsz) sqsz = cqsz;
+  }
+  sq = mmap(NULL, sqsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq = sq;
+  }
+  else {
+    cq = mmap(NULL, cqsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              ring->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) goto fail;
+  }
+  ring->sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe),
+                    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto fail;
+
+  ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  pthread_mutex_init(&ring->lock, NULL);
+  return 0;
+
+ fail:
+  close(ring->fd);
+  return -1;
+}
+
+/* submissions are consumed by io_uring_enter(2) right away, since
+   we do not use SQPOLL; the submission queue never gets full */
+static int
+uring_submit(strm_stream* strm, int op, int fd, void* addr, unsigned len,
+             unsigned events, uint64_t data)
+{
+  struct uring* ring = io_ring(strm, fd);
+  struct io_uring_sqe* sqe;
+  unsigned tail, idx;
+  int r;
+
+  pthread_mutex_lock(&ring->lock);
+  tail = *ring->sq_tail;
+  idx = tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)addr;
+  sqe->len = len;
+  if (op == IORING_OP_READ) {
+    sqe->off = (uint64_t)-1;    /* read from the current position */
+  }
+  sqe->poll_events = events;
+  sqe->user_data = data;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+  do {
+    r = uring_enter(ring, 1, 0, 0);
+  } while (r < 0 && errno == EINTR);
+  pthread_mutex_unlock(&ring->lock);
+  return (r == 1) ? 0 : -1;
+}
+
+static void*
+uring_loop(void* d)
+{
+  struct uring* ring = d;
+  unsigned head, tail;
+
+  for (;;) {
+    if (uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      return NULL;
+    }
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      uint64_t data = cqe->user_data;
+      struct strm_task* task = (struct strm_task*)(uintptr_t)(data & ~(uint64_t)URING_READ);
+
+      if (data & URING_READ) {
+        strm_stream* strm = strm_value_foreign(task->data);
+
+        task->data = strm_int_value(cqe->res);
+        strm_task_add(strm, task);
+      }
+      else {
+        io_task_add(task);
+      }
+      head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+#endif
+
 static int
 io_push(int fd, strm_stream* strm, strm_callback cb)
 {
   struct epoll_event ev = { 0 };
 
+#ifdef STRM_IO_URING
+  if (use_uring) {
+    return uring_submit(strm, IORING_OP_POLL_ADD, fd, NULL, 0, POLLIN,
+                        (uintptr_t)io_task(strm, cb));
+  }
+#endif
   ev.events = EPOLLIN | EPOLLONESHOT;
   ev.data.ptr = io_task(strm, cb);
-  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  return epoll_ctl(io_epoll_fd(strm, fd), EPOLL_CTL_ADD, fd, &ev);
 }
 
 static int
@@ -70,41 +262,130 @@ io_kick(int fd, strm_stream* strm, strm_callback cb)
 {
   struct epoll_event ev;
 
+#ifdef STRM_IO_URING
+  if (use_uring) {
+    return uring_submit(strm, IORING_OP_POLL_ADD, fd, NULL, 0, POLLIN,
+                        (uintptr_t)io_task(strm, cb));
+  }
+#endif
   ev.events = EPOLLIN | EPOLLONESHOT;
   ev.data.ptr = io_task(strm, cb);
-  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  return epoll_ctl(io_epoll_fd(strm, fd), EPOLL_CTL_MOD, fd, &ev);
 }
 
+/* wait until fd gets writable; first call adds fd to the epoll set */
 static int
-io_pop(int fd)
+io_wait_write(int fd, strm_stream* strm, strm_callback cb, int op)
 {
-  return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  struct epoll_event ev = { 0 };
+
+#ifdef STRM_IO_URING
+  if (use_uring) {
+    return uring_submit(strm, IORING_OP_POLL_ADD, fd, NULL, 0, POLLOUT,
+                        (uintptr_t)io_task(strm, cb));
+  }
+#endif
+  ev.events = EPOLLOUT | EPOLLONESHOT;
+  ev.data.ptr = io_task(strm, cb);
+  return epoll_ctl(io_epoll_fd(strm, fd), op, fd, &ev);
+}
+
+static int
+io_pop(strm_stream* strm, int fd)
+{
+#ifdef STRM_IO_URING
+  /* one-shot polls need no removal */
+  if (use_uring) return 0;
+#endif
+  return epoll_ctl(io_epoll_fd(strm, fd), EPOLL_CTL_DEL, fd, NULL);
 }
 
+/* every registration is one-shot: the fd is re-armed by io_kick()
+   after the stream has consumed the data, so a fd is handled by at
+   most one task at a time, and level-triggered events are never
+   reported twice (edge-triggered mode would buy nothing here) */
 static void*
 io_loop(void* d)
 {
-  struct epoll_event events[MAX_EVENTS];
+  int epfd = (int)(intptr_t)d;
+  struct epoll_event* events = malloc(sizeof(struct epoll_event)*STRM_IO_EVENTS);
   int i, n;
 
   for (;;) {
-    n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    n = epoll_wait(epfd, events, STRM_IO_EVENTS, -1);
     if (n < 0) {
-      return NULL;
+      if (errno == EINTR) continue;
+      break;
     }
     for (i=0; i<n; i++) {
       io_task_add(events[i].data.ptr);
     }
   }
+  free(events);
   return NULL;
 }
 
+/* number of threads waiting for I/O events */
+int
+strm_io_thread_count()
+{
+  char *e = getenv("STRM_IO_THREADS");
+  int n = 0;
+
+  if (e) n = atoi(e);
+  if (n <= 0) {
+    /* one I/O thread per 4 workers */
+    n = (strm_worker_count()+3)/4;
+  }
+  if (n > STRM_IO_THREADS) n = STRM_IO_THREADS;
+#if !defined(__linux__) && !defined(__APPLE__) && !defined(__FreeBSD__)
+  /* select(2) emulation in pollfd.c is not thread-safe */
+  n = 1;
+#endif
+  return n;
+}
+
+/* serve the fds of strm by the I/O thread n (modulo the number of
+   threads) instead of sharding them by fd; call before the first wait */
+void
+strm_io_set_thread(strm_stream* strm, int n)
+{
+  strm->flags &= (1u<<STRM_IO_THREAD_SHIFT)-1;
+  strm->flags |= (unsigned int)(n+1) << STRM_IO_THREAD_SHIFT;
+}
+
 void
 strm_init_io_loop()
 {
-  epoll_fd = epoll_create(10);
-  assert(epoll_fd >= 0);
-  pthread_create(&io_worker, NULL, io_loop, NULL);
+  pthread_t th;
+  int i;
+
+  io_nthreads = strm_io_thread_count();
+#ifdef STRM_IO_URING
+  {
+    char* e = getenv("STRM_IO_URING");
+
+    if (!e || atoi(e) != 0) {
+      for (i=0; i<io_nthreads; i++) {
+        if (uring_init(&rings[i]) < 0) break;
+      }
+      if (i > 0) {
+        /* shard over the rings we could set up */
+        io_nthreads = i;
+        use_uring = TRUE;
+        for (i=0; i<io_nthreads; i++) {
+          pthread_create(&th, NULL, uring_loop, &rings[i]);
+        }
+        return;
+      }
+    }
+  }
+#endif
+  for (i=0; i<io_nthreads; i++) {
+    epoll_fds[i] = epoll_create(STRM_IO_EVENTS);
+    assert(epoll_fds[i] >= 0);
+    pthread_create(&th, NULL, io_loop, (void*)(intptr_t)epoll_fds[i]);
+  }
 }
 
 void
@@ -120,11 +401,18 @@ strm_io_stop(strm_stream* strm, int fd)
 {
   if ((strm->flags & STRM_IO_NOWAIT) == 0) {
     io_wait_num--;
-    io_pop(fd);
+    io_pop(strm, fd);
   }
   strm_stream_close(strm);
 }
 
+/* wait for fd to get readable again after strm_io_start_read() */
+void
+strm_io_kick(strm_stream* strm, int fd, strm_callback cb)
+{
+  io_kick(fd, strm, cb);
+}
+
 void
 strm_io_emit(strm_stream* strm, strm_value data, int fd, strm_callback cb)
 {
@@ -132,27 +420,133 @@ strm_io_emit(strm_stream* strm, strm_value data, int fd, strm_callback cb)
   io_kick(fd, strm, cb);
 }
 
+/* size of chunks for read(2); lines are emitted as slices of chunks.
+   chunks grow while reads fill them, up to STRM_READ_MAX (which can
+   be overridden by the environment variable of the same name) */
+#ifndef STRM_READ_CHUNK
+#define STRM_READ_CHUNK (16*1024)
+#endif
+#ifndef STRM_READ_MAX
+#define STRM_READ_MAX (1024*1024)
+#endif
+
+/* max number of lines emitted at once */
+#ifndef STRM_READ_BATCH
+#define STRM_READ_BATCH 256
+#endif
+
 struct fd_read_buffer {
   int fd;
   char *beg, *end;
   strm_io io;
-#ifdef STRM_IO_MMAP
   char *buf;
-  char fixed[BUFSIZ];
-#else
-  char buf[BUFSIZ];
-#endif
+  size_t capa;                  /* size of the current chunk */
+  size_t next;                  /* size of the next chunk */
+  size_t max;
+  char *done;                   /* mmap: pages before this are released */
 };
 
+#ifdef STRM_IO_MMAP
+/* mapped regions are never unmapped since lines are slices of them.
+   instead, pages more than STRM_MMAP_WINDOW behind the cursor are
+   released by MADV_DONTNEED (they are read from the file again if
+   touched), and the next window is prefetched, to keep RSS bounded */
+#ifndef STRM_MMAP_WINDOW
+#define STRM_MMAP_WINDOW (16*1024*1024)
+#endif
+
+static char*
+mmap_advance(char* done, char* cur, char* end)
+{
+  static uintptr_t page = 0;
+  uintptr_t beg, lim;
+
+  if (cur - done < 2*STRM_MMAP_WINDOW) return done;
+  if (page == 0) page = sysconf(_SC_PAGESIZE);
+  beg = ((uintptr_t)done + page-1) & ~(page-1);
+  lim = ((uintptr_t)cur - STRM_MMAP_WINDOW) & ~(page-1);
+#ifdef MADV_DONTNEED
+  if (lim > beg) madvise((void*)beg, lim-beg, MADV_DONTNEED);
+#endif
+#ifdef MADV_WILLNEED
+  beg = (uintptr_t)cur & ~(page-1);
+  if (end - (char*)beg > STRM_MMAP_WINDOW)
+    madvise((void*)beg, STRM_MMAP_WINDOW, MADV_WILLNEED);
+  else
+    madvise((void*)beg, end - (char*)beg, MADV_WILLNEED);
+#endif
+  return (char*)lim;
+}
+#endif
+
+static size_t
+read_max(void)
+{
+  char* e = getenv("STRM_READ_MAX");
+  long n;
+
+  if (e) {
+    n = atol(e);
+    if (n >= STRM_READ_CHUNK) return n;
+  }
+  return STRM_READ_MAX;
+}
+
 static int readline_cb(strm_stream* strm, strm_value data);
+static int read_cb(strm_stream* strm, strm_value data);
 
+/* strings refer to the read buffer, which will never be reused;
+   a chunk is kept alive by the strings made from it */
 static strm_value
 read_str(const char* beg, strm_int len)
 {
-  char *p = malloc(len);
+  return strm_str_value(strm_str_slice(beg, len));
+}
+
+/* move the incomplete line at the end of a full chunk to a new chunk;
+   a line longer than the chunk gets a chunk twice as large */
+static int
+read_chunk_new(struct fd_read_buffer *b)
+{
+  size_t len = b->end - b->beg;
+  size_t capa = b->next;
+  char *p;
+
+  while (capa < len*2) capa *= 2;
+  /* extra byte to let slice strings peek at ptr[len] */
+  p = malloc(capa+1);
+  if (!p) return STRM_NG;
+  memcpy(p, b->beg, len);
+  b->buf = b->beg = p;
+  b->end = p + len;
+  b->capa = capa;
+  return STRM_OK;
+}
+
+/* wait for input and call read_cb; with io_uring, the read itself is
+   done asynchronously and read_cb receives its result */
+static void
+read_wait(strm_stream* strm, struct fd_read_buffer *b, int first)
+{
+  if (strm->flags & STRM_IO_NOWAIT) {
+    strm_task_push(strm, read_cb, strm_nil_value());
+    return;
+  }
+#ifdef STRM_IO_URING
+  if (use_uring) {
+    struct strm_task* t = io_task(strm, read_cb);
 
-  memcpy(p, beg, len);
-  return strm_str_value(strm_str_new(p, len));
+    if (uring_submit(strm, IORING_OP_READ, b->fd, b->end, b->capa-(b->end-b->buf),
+                     0, (uintptr_t)t|URING_READ) == 0 && first) {
+      io_wait_num++;
+    }
+    return;
+  }
+#endif
+  if (first)
+    strm_io_start_read(strm, b->fd, read_cb);
+  else
+    io_kick(b->fd, strm, read_cb);
 }
 
 static int
@@ -162,19 +556,58 @@ read_cb(strm_stream* strm, strm_value data)
   strm_int count;
   strm_int n;
 
-  count = BUFSIZ-(b->end-b->buf);
-  n = strm_read(b->fd, b->end, count);
-  if (n <= 0) {
-    if (b->buf < b->end) {
+  count = b->capa-(b->end-b->buf);
+  if (strm_int_p(data)) {       /* already read by io_uring */
+    n = strm_value_int(data);
+    if (n < 0) {                /* -errno */
+      errno = -n;
+      n = -1;
+    }
+  }
+  else {
+    n = strm_read(b->fd, b->end, count);
+  }
+  if (n < 0) {
+    switch (errno) {
+    case EINTR:
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+#ifdef ECANCELED
+    case ECANCELED:
+#endif
+      /* transient; wait and read again */
+      read_wait(strm, b, FALSE);
+      return STRM_OK;
+    default:
+      break;
+    }
+    strm_raise(strm, strerror(errno));
+    if (b->beg < b->end) {
+      strm_emit(strm, read_str(b->beg, b->end-b->beg), NULL);
+      b->beg = b->end;
+    }
+    strm_io_stop(strm, b->fd);
+    return STRM_NG;
+  }
+  if (n == 0) {
+    if (b->beg < b->end) {
       strm_value s = read_str(b->beg, b->end-b->beg);
-      b->beg = b->end = b->buf;
-      strm_io_emit(strm, s, b->fd, read_cb);
+      b->beg = b->end;
+      strm_emit(strm, s, NULL);
+      read_wait(strm, b, FALSE);
     }
     else {
       strm_io_stop(strm, b->fd);
     }
     return STRM_OK;
   }
+  /* the read filled the buffer; use larger chunks from now on */
+  if (n == count && b->next < b->max) {
+    b->next *= 2;
+    if (b->next > b->max) b->next = b->max;
+  }
   b->end += n;
   (*readline_cb)(strm, strm_nil_value());
   return STRM_OK;
@@ -186,42 +619,49 @@ readline_cb(strm_stream* strm, strm_value data)
   struct fd_read_buffer *b = strm->data;
   strm_value s;
   char *p;
-  strm_int len = b->end-b->beg;
+  strm_int len;
+  strm_int n = 0;
 
-  p = memchr(b->beg, '\n', len);
-  if (p) {
-    len = p - b->beg;
+#ifdef STRM_IO_MMAP
+  if (strm->flags & STRM_IO_NOFILL) {
+    b->done = mmap_advance(b->done, b->beg, b->end);
+  }
+#endif
+  /* emit up to STRM_READ_BATCH lines per task */
+  while ((p = memchr(b->beg, '\n', b->end-b->beg)) != NULL) {
+    s = read_str(b->beg, p - b->beg);
+    b->beg = p + 1;
+    if (++n == STRM_READ_BATCH) {
+      strm_emit(strm, s, readline_cb);
+      return STRM_OK;
+    }
+    strm_emit(strm, s, NULL);
+    if (strm->mode == strm_dying) return STRM_OK;
   }
+  len = b->end-b->beg;
   /* no newline */
-  else if (strm->flags & STRM_IO_NOFILL) {
+  if (strm->flags & STRM_IO_NOFILL) {
     if (len <= 0) {
-#ifdef STRM_IO_MMAP
-      if (strm->flags & STRM_IO_MMAP) {
-        munmap(b->buf, b->end - b->beg);
-      }
-#endif
+      /* lines may refer to the mapped region; never munmap() */
       strm_io_stop(strm, b->fd);
       return STRM_OK;
     }
+    /* last line without newline: the next byte may not be mapped */
+    s = strm_str_value(strm_str_new(b->beg, len));
+    b->beg = b->end;
+    strm_emit(strm, s, readline_cb);
+    return STRM_OK;
   }
   else {
-    if (len < sizeof(b->buf)) {
-      memmove(b->buf, b->beg, len);
-      b->beg = b->buf;
-      b->end = b->beg + len;
-    }
-    if (strm->flags & STRM_IO_NOWAIT) {
-      strm_task_push(strm, read_cb, strm_nil_value());
-    }
-    else {
-      io_kick(b->fd, strm, read_cb);
+    if (b->end == b->buf + b->capa) {
+      if (read_chunk_new(b) == STRM_NG) {
+        strm_raise(strm, "cannot allocate read buffer");
+        return STRM_NG;
+      }
     }
+    read_wait(strm, b, FALSE);
     return STRM_OK;
   }
-  s = read_str(b->beg, len);
-  b->beg += len + 1;
-  strm_emit(strm, s, readline_cb);
-  return STRM_OK;
 }
 
 static int
@@ -229,7 +669,7 @@ stdio_read(strm_stream* strm, strm_value data)
 {
   struct fd_read_buffer *b = strm->data;
 
-  strm_io_start_read(strm, b->fd, read_cb);
+  read_wait(strm, b, TRUE);
   return STRM_OK;
 }
 
@@ -238,7 +678,10 @@ read_close(strm_stream* strm, strm_value d)
 {
   struct fd_read_buffer *b = strm->data;
 
-  close(b->fd);
+  /* the fd is closed by whichever of reader and writer finishes last */
+  if ((strm_atomic_and(b->io->mode, ~STRM_IO_READING) & STRM_IO_WRITING) == 0) {
+    close(b->fd);
+  }
   free(b);
   return STRM_OK;
 }
@@ -253,34 +696,41 @@ strm_readio(strm_io io)
     struct fd_read_buffer *buf = malloc(sizeof(struct fd_read_buffer));
     struct stat st;
 
-    io->mode |= STRM_IO_READING;
+    strm_atomic_or(io->mode, STRM_IO_READING);
     buf->fd = io->fd;
     buf->io = io;
-#ifdef STRM_IO_MMAP
-    buf->buf = buf->fixed;
-#endif
+    buf->capa = buf->next = STRM_READ_CHUNK;
+    buf->max = read_max();
+    buf->buf = malloc(buf->capa+1);
 
     if (fstat(io->fd, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG) {
       /* fd must be a regular file */
       /* try mmap if STRM_IO_MMAP is defined */
       flags |= STRM_IO_NOWAIT;
+      /* stdio_read (epoll) does not work for regular files */
+      cb = read_cb;
+      buf->beg = buf->end = buf->buf;
 #ifdef STRM_IO_MMAP
       void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, buf->fd, 0);
-      if (map == MAP_FAILED) {
-        buf->beg = buf->end = buf->buf;
-      }
-      else {
-        buf->buf = buf->beg = map;
+      if (map != MAP_FAILED) {
+        free(buf->buf);
+        buf->buf = buf->beg = buf->done = map;
         buf->end = map + st.st_size;
+#ifdef MADV_SEQUENTIAL
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
         flags |= STRM_IO_NOFILL;
         /* enqueue task without waiting */
         cb = readline_cb;
       }
-#else
-      /* stdio_read (epoll) does not work for regular files */
-      cb = read_cb;
-      buf->beg = buf->end = buf->buf;
 #endif
+      if (cb == read_cb) {
+        /* regular files are read sequentially; start with large chunks */
+        buf->next = buf->max;
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(buf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+      }
     }
     else {
       buf->beg = buf->end = buf->buf;
@@ -291,56 +741,565 @@ strm_readio(strm_io io)
   return io->read_stream;
 }
 
+#ifdef STRM_IO_MMAP
+/* parallel reading of a regular file: the mapped region is split into
+   chunks at newline boundaries, and each chunk is split into lines by
+   its own producer.  chunks send batches of lines to the hub stream,
+   which emits them as they arrive, or in file order in ordered mode. */
+
+/* batches a chunk may send ahead of the hub */
+#ifndef STRM_PREAD_CREDIT
+#define STRM_PREAD_CREDIT 16
+#endif
+
+struct pread_batch {
+  struct pread_batch* next;
+  strm_int idx;                 /* chunk index */
+  int last;                     /* last batch of the chunk */
+  strm_int len;
+  strm_value lines[STRM_READ_BATCH];
+};
+
+struct pread_chunk {
+  char *beg, *end;
+  char *done;
+  strm_stream* hub;
+  strm_int idx;
+  int credit;
+  int refcnt;                   /* referred from the chunk and the hub */
+};
+
+struct pread_data {
+  int fd;
+  int ordered;
+  strm_int n;
+  strm_int cur;                 /* number of finished chunks */
+  struct pread_batch** pend;    /* batches waiting for their turn */
+  struct pread_batch** tail;
+  strm_stream** chunk;
+  char *beg, *end;
+};
+
+static int pread_chunk_cb(strm_stream* strm, strm_value data);
+
+static void
+pread_emit(strm_stream* strm, struct pread_batch* batch)
+{
+  struct pread_data* d = strm->data;
+  strm_stream* chunk = d->chunk[batch->idx];
+  struct pread_chunk* c;
+  strm_int i;
+
+  for (i=0; i<batch->len; i++) {
+    strm_emit(strm, batch->lines[i], NULL);
+  }
+  if (batch->last) {
+    d->cur++;
+  }
+  else {
+    c = chunk->data;
+    /* give credit back; resume the chunk if it has been paused */
+    if (strm_atomic_inc(c->credit) == 0) {
+      strm_task_push(chunk, pread_chunk_cb, strm_nil_value());
+    }
+  }
+  free(batch);
+}
+
+static int
+pread_collect(strm_stream* strm, strm_value data)
+{
+  struct pread_data* d = strm->data;
+  struct pread_batch* batch = strm_value_foreign(data);
+
+  if (d->ordered && batch->idx != d->cur) {
+    batch->next = NULL;
+    if (d->tail[batch->idx])
+      d->tail[batch->idx]->next = batch;
+    else
+      d->pend[batch->idx] = batch;
+    d->tail[batch->idx] = batch;
+    return STRM_OK;
+  }
+  pread_emit(strm, batch);
+  while (d->ordered && d->cur < d->n && d->pend[d->cur]) {
+    strm_int i = d->cur;
+
+    while ((batch = d->pend[i]) != NULL) {
+      d->pend[i] = batch->next;
+      pread_emit(strm, batch);
+    }
+    d->tail[i] = NULL;
+  }
+  if (d->cur == d->n) {
+    strm_stream_close(strm);
+  }
+  return STRM_OK;
+}
+
+static int
+pread_chunk_cb(strm_stream* strm, strm_value data)
+{
+  struct pread_chunk* c = strm->data;
+  struct pread_batch* batch;
+  char *p;
+
+  if (c->hub->mode == strm_dying || c->hub->mode == strm_killed) {
+    strm_stream_close(strm);
+    return STRM_OK;
+  }
+  c->done = mmap_advance(c->done, c->beg, c->end);
+  batch = malloc(sizeof(struct pread_batch));
+  if (!batch) return STRM_NG;
+  batch->idx = c->idx;
+  batch->len = 0;
+  while (batch->len < STRM_READ_BATCH && c->beg < c->end) {
+    p = memchr(c->beg, '\n', c->end-c->beg);
+    if (p) {
+      batch->lines[batch->len++] = read_str(c->beg, p-c->beg);
+      c->beg = p + 1;
+    }
+    else {
+      /* last line without newline: the next byte may not be mapped */
+      batch->lines[batch->len++] = strm_str_new(c->beg, c->end-c->beg);
+      c->beg = c->end;
+    }
+  }
+  batch->last = (c->beg == c->end);
+  strm_task_push(c->hub, pread_collect, strm_foreign_value(batch));
+  if (batch->last) {
+    strm_stream_close(strm);
+    return STRM_OK;
+  }
+  /* out of credit; pread_emit() will resume us */
+  if (strm_atomic_dec(c->credit) == 1) return STRM_OK;
+  strm_task_push(strm, pread_chunk_cb, strm_nil_value());
+  return STRM_OK;
+}
+
+static void
+pread_chunk_free(struct pread_chunk* c)
+{
+  if (strm_atomic_dec(c->refcnt) == 1) {
+    free(c);
+  }
+}
+
+static int
+pread_chunk_close(strm_stream* strm, strm_value data)
+{
+  pread_chunk_free(strm->data);
+  return STRM_OK;
+}
+
+static strm_stream*
+pread_chunk_new(strm_stream* hub, strm_int idx, char* beg, char* end)
+{
+  struct pread_chunk* c = malloc(sizeof(struct pread_chunk));
+
+  if (!c) return NULL;
+  c->beg = c->done = beg;
+  c->end = end;
+  c->hub = hub;
+  c->idx = idx;
+  c->credit = STRM_PREAD_CREDIT;
+  c->refcnt = 2;
+  return strm_stream_new(strm_producer, pread_chunk_cb, pread_chunk_close, (void*)c);
+}
+
+static int
+pread_start(strm_stream* strm, strm_value data)
+{
+  struct pread_data* d = strm->data;
+  char *beg = d->beg;
+  char *end, *p;
+  strm_int i, n = 0;
+
+  /* split the region at newline boundaries */
+  for (i=0; i<d->n && beg<d->end; i++) {
+    end = beg + (d->end-d->beg)/d->n;
+    if (i == d->n-1 || end >= d->end) {
+      end = d->end;
+    }
+    else {
+      p = memchr(end, '\n', d->end-end);
+      end = p ? p+1 : d->end;
+    }
+    d->chunk[n] = pread_chunk_new(strm, n, beg, end);
+    if (!d->chunk[n]) return STRM_NG;
+    n++;
+    beg = end;
+  }
+  d->n = n;
+  if (n == 0) {
+    strm_stream_close(strm);
+    return STRM_OK;
+  }
+  for (i=0; i<n; i++) {
+    strm_task_push(d->chunk[i], pread_chunk_cb, strm_nil_value());
+  }
+  return STRM_OK;
+}
+
+static int
+pread_close(strm_stream* strm, strm_value data)
+{
+  struct pread_data* d = strm->data;
+  strm_int i;
+
+  /* wake up paused chunks so that they can finish */
+  for (i=0; i<d->n; i++) {
+    struct pread_chunk* c = d->chunk[i]->data;
+
+    strm_task_push(d->chunk[i], pread_chunk_cb, strm_nil_value());
+    pread_chunk_free(c);
+  }
+  /* lines refer to the mapped region; never munmap() */
+  close(d->fd);
+  free(d->pend);
+  free(d->tail);
+  free(d->chunk);
+  free(d);
+  return STRM_OK;
+}
+#endif
+
+/* read a regular file by n producers in parallel; returns NULL if
+   the file cannot be read that way */
+strm_stream*
+strm_readio_parallel(int fd, strm_int n, int ordered)
+{
+#ifdef STRM_IO_MMAP
+  struct pread_data* d;
+  struct stat st;
+  void* map;
+
+  if (n <= 1) return NULL;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return NULL;
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return NULL;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+  d = malloc(sizeof(struct pread_data));
+  if (!d) goto fail;
+  d->fd = fd;
+  d->ordered = ordered;
+  d->n = n;
+  d->cur = 0;
+  d->beg = map;
+  d->end = d->beg + st.st_size;
+  d->pend = calloc(n, sizeof(struct pread_batch*));
+  d->tail = calloc(n, sizeof(struct pread_batch*));
+  d->chunk = calloc(n, sizeof(strm_stream*));
+  if (!d->pend || !d->tail || !d->chunk) {
+    free(d->pend);
+    free(d->tail);
+    free(d->chunk);
+    free(d);
+    goto fail;
+  }
+  return strm_stream_new(strm_producer, pread_start, pread_close, (void*)d);
+ fail:
+  munmap(map, st.st_size);
+  return NULL;
+#else
+  return NULL;
+#endif
+}
+
+/* output buffer size; records are coalesced up to this size */
+#ifndef STRM_WRITE_BUFSIZ
+#define STRM_WRITE_BUFSIZ (64*1024)
+#endif
+
+/* limit of unsent output per socket; a peer that does not read
+   that much is dropped */
+#ifndef STRM_WRITE_PENDING_MAX
+#define STRM_WRITE_PENDING_MAX (1024*1024)
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 struct write_data {
   FILE *f;
   strm_io io;
+  int defer;                    /* regular file: flush only when full */
+  int sock;                     /* socket: non-blocking send */
+  int wfd;                      /* dup of fd registered for EPOLLOUT */
+  int waiting;                  /* waiting for EPOLLOUT */
+  int dropped;
+  int closing;                  /* closed with pending output */
+  char *pend;                   /* output waiting for EPOLLOUT */
+  size_t poff, plen, pcapa;
+  size_t len;
+  char buf[STRM_WRITE_BUFSIZ];
 };
 
+#ifndef _WIN32
 static int
-write_cb(strm_stream* strm, strm_value data)
+write_all(int fd, const char* p, size_t len)
 {
-  struct write_data *d = (struct write_data*)strm->data;
-  strm_string p = strm_to_str(data);
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd;
+
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      return STRM_NG;
+    }
+    p += n;
+    len -= n;
+  }
+  return STRM_OK;
+}
+#endif
 
 #ifndef _WIN32
-  struct iovec buf[2];
+/* send as much as possible without blocking; returns bytes sent or -1 */
+static ssize_t
+write_nb(int fd, const char* p, size_t len)
+{
+  size_t total = 0;
+
+  while (total < len) {
+    ssize_t n = send(fd, p+total, len-total, MSG_DONTWAIT|MSG_NOSIGNAL);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    total += n;
+  }
+  return total;
+}
+
+static void
+write_drop(strm_stream* strm, struct write_data* d)
+{
+  d->dropped = TRUE;
+  /* nothing can be written any more */
+  if (strm->mode != strm_killed) {
+    strm->mode = strm_dying;
+  }
+  d->poff = d->plen = 0;
+  /* let the reading side (if any) see EOF as well */
+  shutdown(fileno(d->f), SHUT_RDWR);
+}
+
+static int write_ready_cb(strm_stream* strm, strm_value data);
+
+static int
+write_wait(strm_stream* strm, struct write_data* d)
+{
+  int op = EPOLL_CTL_MOD;
+
+  if (d->waiting) return STRM_OK;
+  if (d->wfd < 0) {
+    /* the fd itself may be registered for reading */
+    d->wfd = dup(fileno(d->f));
+    if (d->wfd < 0) return STRM_NG;
+    op = EPOLL_CTL_ADD;
+  }
+  if (io_wait_write(d->wfd, strm, write_ready_cb, op) < 0) {
+    return STRM_NG;
+  }
+  d->waiting = TRUE;
+  return STRM_OK;
+}
+
+static int
+write_pending(strm_stream* strm, struct write_data* d, const char* p, size_t len)
+{
+  ssize_t n;
 
-  buf[0].iov_base = (void*)strm_str_ptr(p);
-  buf[0].iov_len = strm_str_len(p);
-  buf[1].iov_base = (void*)"\n";
-  buf[1].iov_len = 1;
-  if (writev(fileno(d->f), buf, 2) < 0) {
+  if (d->dropped) return STRM_OK;
+  if (d->plen == 0) {
+    n = write_nb(fileno(d->f), p, len);
+    if (n < 0) {
+      write_drop(strm, d);
+      return STRM_NG;
+    }
+    if ((size_t)n == len) return STRM_OK;
+    p += n;
+    len -= n;
+  }
+  if (d->plen + len > STRM_WRITE_PENDING_MAX) {
+    write_drop(strm, d);
+    strm_raise(strm, "output buffer overflow; connection dropped");
     return STRM_NG;
   }
+  if (d->poff + d->plen + len > d->pcapa) {
+    if (d->poff > 0) {
+      memmove(d->pend, d->pend+d->poff, d->plen);
+      d->poff = 0;
+    }
+    if (d->plen + len > d->pcapa) {
+      size_t capa = d->pcapa ? d->pcapa : STRM_WRITE_BUFSIZ;
+      char *pend;
+
+      while (capa < d->plen + len) capa *= 2;
+      pend = realloc(d->pend, capa);
+      if (!pend) return STRM_NG;
+      d->pend = pend;
+      d->pcapa = capa;
+    }
+  }
+  memcpy(d->pend+d->poff+d->plen, p, len);
+  d->plen += len;
+  return write_wait(strm, d);
+}
+
+static int
+write_ready_cb(strm_stream* strm, strm_value data)
+{
+  struct write_data *d = (struct write_data*)strm->data;
+  ssize_t n;
+
+  d->waiting = FALSE;
+  if (d->dropped) return STRM_OK;
+  if (d->plen > 0) {
+    n = write_nb(fileno(d->f), d->pend+d->poff, d->plen);
+    if (n < 0) {
+      write_drop(strm, d);
+      return STRM_NG;
+    }
+    d->poff += n;
+    d->plen -= n;
+  }
+  if (d->plen == 0) {
+    d->poff = 0;
+    /* drained after close; let write_finish() close the fd */
+    if (d->closing) {
+      strm->mode = strm_dying;
+    }
+    return STRM_OK;
+  }
+  return write_wait(strm, d);
+}
+#endif
+
+static int
+write_flush(strm_stream* strm, struct write_data* d)
+{
+  size_t len = d->len;
+
+  if (len == 0) return STRM_OK;
+  d->len = 0;
+#ifndef _WIN32
+  if (d->sock) {
+    return write_pending(strm, d, d->buf, len);
+  }
+  return write_all(fileno(d->f), d->buf, len);
 #else
-  fwrite(strm_str_ptr(p), strm_str_len(p), 1, d->f);
-  fputs("\n", d->f);
-  if (d->io->mode & STRM_IO_FLUSH) {
-    fflush(d->f);
+  fwrite(d->buf, len, 1, d->f);
+  fflush(d->f);
+  return STRM_OK;
+#endif
+}
+
+static int
+write_cb(strm_stream* strm, strm_value data)
+{
+  struct write_data *d = (struct write_data*)strm->data;
+  strm_string p = strm_to_str(data);
+  const char* s = strm_str_ptr(p);
+  size_t len = strm_str_len(p);
+
+  if (d->len + len + 1 > sizeof(d->buf)) {
+    if (write_flush(strm, d) == STRM_NG) return STRM_NG;
   }
+  if (len + 1 > sizeof(d->buf)) {
+#ifndef _WIN32
+    int n;
+
+    if (d->sock)
+      n = write_pending(strm, d, s, len);
+    else
+      n = write_all(fileno(d->f), s, len);
+    if (n == STRM_NG) return STRM_NG;
+#else
+    fwrite(s, len, 1, d->f);
 #endif
+  }
+  else {
+    memcpy(d->buf + d->len, s, len);
+    d->len += len;
+  }
+  d->buf[d->len++] = '\n';
+  /* flush at the end of each burst, i.e. no more queued records */
+  if (!d->defer && strm_queue_empty_p(strm->queue)) {
+    return write_flush(strm, d);
+  }
   return STRM_OK;
 }
 
 static int
-write_close(strm_stream* strm, strm_value data)
+write_finish(strm_stream* strm, strm_value data)
 {
   struct write_data *d = (struct write_data*)strm->data;
 
+#ifndef _WIN32
+  if (d->wfd >= 0) {
+    io_pop(strm, d->wfd);
+    close(d->wfd);
+  }
+  free(d->pend);
+#endif
   /* tell peer we close the socket for writing (if it is) */
   shutdown(fileno(d->f), 1);
   /* if we have a reading strm, let it close the fd */
-  if ((d->io->mode & STRM_IO_READING) == 0) {
+  if ((strm_atomic_and(d->io->mode, ~STRM_IO_WRITING) & STRM_IO_READING) == 0) {
     fclose(d->f);
   }
   free(d);
+  strm->data = NULL;
   return STRM_OK;
 }
 
+static int
+write_close(strm_stream* strm, strm_value data)
+{
+  struct write_data *d = (struct write_data*)strm->data;
+
+  write_flush(strm, d);
+#ifndef _WIN32
+  /* pending output is sent on EPOLLOUT by a lingering stream (this one
+     is closed), which closes the fd once it drains or the peer is gone;
+     no worker waits for a slow peer */
+  if (d->plen > 0 && !d->dropped) {
+    strm_stream* linger = strm_stream_new(strm_consumer, NULL, write_finish, (void*)d);
+
+    d->closing = TRUE;
+    d->waiting = FALSE;
+    if (write_wait(linger, d) == STRM_OK) {
+      strm->data = NULL;
+      return STRM_OK;
+    }
+    linger->close_func = NULL;
+    linger->data = NULL;
+    strm_stream_close(linger);
+  }
+#endif
+  return write_finish(strm, data);
+}
+
 static strm_stream*
 strm_writeio(strm_io io)
 {
   struct write_data *d;
+  struct stat st;
 
   if (!io->write_stream) {
     d = malloc(sizeof(struct write_data));
@@ -354,7 +1313,20 @@ strm_writeio(strm_io io)
 #else
     d->f = fdopen(io->fd, "w");
 #endif
+    strm_atomic_or(io->mode, STRM_IO_WRITING);
     d->io = io;
+    d->len = 0;
+    d->defer = d->sock = FALSE;
+    d->wfd = -1;
+    d->waiting = d->dropped = d->closing = FALSE;
+    d->pend = NULL;
+    d->poff = d->plen = d->pcapa = 0;
+    if (fstat(io->fd, &st) == 0) {
+      d->defer = (io->mode & STRM_IO_FLUSH) == 0 && S_ISREG(st.st_mode);
+#ifndef _WIN32
+      d->sock = S_ISSOCK(st.st_mode);
+#endif
+    }
     io->write_stream = strm_stream_new(strm_consumer, write_cb, write_close, (void*)d);
   }
   return io->write_stream;
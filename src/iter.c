@@ -1,5 +1,7 @@
 #include "strm.h"
+#include "atomic.h"
 #include "khash.h"
+#include <math.h>
 
 struct seq_data {
   double n;
@@ -251,6 +253,222 @@ ary_map(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return STRM_OK;
 }
 
+/* parallel map: records are distributed to replica streams; at most
+   PMAP_INFLIGHT records per replica are being mapped (or waiting to be
+   emitted in order), and further records wait in arrival order */
+struct pmap_item {
+  uint64_t seq;
+  strm_value v;
+  int ok;
+  struct pmap_item* next;       /* in the wait list */
+};
+
+struct pmap_data {
+  strm_value func;
+  strm_int ordered;
+  uint64_t seq;                 /* next sequence number to dispatch */
+  uint64_t next;                /* next sequence number to emit */
+  strm_int max;                 /* max number of records in flight */
+  strm_int capa;                /* size of reorder buffer (power of 2) */
+  struct pmap_item** slots;     /* reorder buffer */
+  struct pmap_item* wait;       /* records waiting for a free slot */
+  struct pmap_item** wtail;
+  strm_int i;
+  strm_int n;
+  strm_stream* replica[0];
+};
+
+#ifndef PMAP_INFLIGHT
+#define PMAP_INFLIGHT 2
+#endif
+
+static int pmap_exec(strm_stream* strm, strm_value data);
+
+static void
+pmap_dispatch(strm_stream* strm, struct pmap_data* d, struct pmap_item* item)
+{
+  item->seq = d->seq++;
+  /* keep the stream open until the result comes back */
+  strm_atomic_inc(strm->refcnt);
+  strm_task_push(d->replica[d->i], pmap_exec, strm_foreign_value(item));
+  d->i = (d->i+1) % d->n;
+}
+
+static void
+pmap_free_wait(struct pmap_data* d)
+{
+  struct pmap_item* item;
+
+  while ((item = d->wait) != NULL) {
+    d->wait = item->next;
+    free(item);
+  }
+  d->wtail = &d->wait;
+}
+
+static int
+pmap_collect(strm_stream* strm, strm_value data)
+{
+  struct pmap_data* d = strm->data;
+  struct pmap_item* item = strm_value_foreign(data);
+
+  if (strm->mode == strm_dying) {
+    /* no one takes the results; task_exec() closes the stream after
+       this task, which releases the reference of the item */
+    free(item);
+    pmap_free_wait(d);
+    return STRM_OK;
+  }
+  if (!d->ordered) {
+    d->next++;
+    if (item->ok) {
+      strm_emit(strm, item->v, NULL);
+    }
+    free(item);
+  }
+  else {
+    strm_int mask = d->capa-1;
+
+    d->slots[item->seq & mask] = item;
+    while ((item = d->slots[d->next & mask]) != NULL) {
+      d->slots[d->next & mask] = NULL;
+      d->next++;
+      if (item->ok) {
+        strm_emit(strm, item->v, NULL);
+      }
+      free(item);
+    }
+  }
+  /* dispatch waiting records to the freed slots */
+  while (d->wait && d->seq - d->next < d->max) {
+    item = d->wait;
+    d->wait = item->next;
+    if (!d->wait) d->wtail = &d->wait;
+    pmap_dispatch(strm, d, item);
+  }
+  /* release reference taken in pmap_dispatch() */
+  strm_stream_close(strm);
+  return STRM_OK;
+}
+
+static int
+pmap_exec(strm_stream* strm, strm_value data)
+{
+  strm_stream* pmap = strm->data;
+  struct pmap_data* d = pmap->data;
+  struct pmap_item* item = strm_value_foreign(data);
+  int n;
+
+  n = strm_funcall(strm, d->func, 1, &item->v, &item->v);
+  item->ok = (n == STRM_OK);
+  /* emit from the function is not supported; keep replica alive */
+  if (strm->mode == strm_dying) {
+    strm->mode = strm_filter;
+  }
+  /* the reference taken for the item keeps pmap from being killed;
+     whether it is dying is checked by pmap_collect() on its own worker */
+  strm_task_add(pmap, strm_task_new(pmap_collect, strm_foreign_value(item)));
+  return n;
+}
+
+static int
+replica_close(strm_stream* strm, strm_value data)
+{
+  return STRM_OK;
+}
+
+static int
+iter_pmap(strm_stream* strm, strm_value data)
+{
+  struct pmap_data* d = strm->data;
+  struct pmap_item* item;
+  strm_int i;
+
+  if (d->replica[0] == NULL) {
+    for (i=0; i<d->n; i++) {
+      d->replica[i] = strm_stream_new(strm_filter, pmap_exec, replica_close, (void*)strm);
+    }
+  }
+  item = malloc(sizeof(struct pmap_item));
+  if (!item) return STRM_NG;
+  item->v = data;
+  item->ok = FALSE;
+  item->next = NULL;
+  if (d->wait || d->seq - d->next >= d->max) {
+    /* too many records in flight; wait for a result to come back */
+    *d->wtail = item;
+    d->wtail = &item->next;
+    return STRM_OK;
+  }
+  pmap_dispatch(strm, d, item);
+  return STRM_OK;
+}
+
+static int
+pmap_finish(strm_stream* strm, strm_value data)
+{
+  struct pmap_data* d = strm->data;
+  strm_int i;
+
+  if (d->replica[0]) {
+    for (i=0; i<d->n; i++) {
+      strm_task_push(d->replica[i], (strm_callback)strm_stream_close, strm_nil_value());
+    }
+  }
+  pmap_free_wait(d);
+  free(d->slots);
+  free(d);
+  return STRM_OK;
+}
+
+static int
+exec_pmap(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  struct pmap_data* d;
+  strm_value func;
+  strm_int n = 0;
+  strm_int ordered = TRUE;
+
+  switch (argc) {
+  case 1:
+    strm_get_args(strm, argc, args, "v", &func);
+    break;
+  case 2:
+    strm_get_args(strm, argc, args, "iv", &n, &func);
+    break;
+  default:
+    strm_get_args(strm, argc, args, "ibv", &n, &ordered, &func);
+    break;
+  }
+  if (argc == 1) {
+    n = strm_worker_count();
+  }
+  if (n <= 0) {
+    strm_raise(strm, "invalid number of replicas");
+    return STRM_NG;
+  }
+  d = malloc(sizeof(*d)+sizeof(strm_stream*)*n);
+  if (!d) return STRM_NG;
+  d->func = func;
+  d->ordered = ordered;
+  d->seq = d->next = 0;
+  d->max = n*PMAP_INFLIGHT;
+  d->capa = 1;
+  while (d->capa < d->max) d->capa *= 2;
+  d->slots = calloc(d->capa, sizeof(struct pmap_item*));
+  if (!d->slots) {
+    free(d);
+    return STRM_NG;
+  }
+  d->wait = NULL;
+  d->wtail = &d->wait;
+  d->i = 0;
+  d->n = n;
+  memset(d->replica, 0, sizeof(strm_stream*)*n);
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_pmap, pmap_finish, (void*)d));
+  return STRM_OK;
+}
+
 static int
 iter_flatmap(strm_stream* strm, strm_value data)
 {
@@ -552,64 +770,148 @@ exec_reduce(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 }
 
 
-KHASH_MAP_INIT_INT64(rbk, strm_value);
+/* keys are compared by content, so that equal strings are one key */
+#define rbk_hash(v) (khint32_t)strm_value_hash(v)
+KHASH_INIT(rbk, strm_value, strm_value, 1, rbk_hash, strm_value_eq);
 
 struct rbk_data {
   khash_t(rbk) *tbl;
   strm_value func;
+  strm_int n;                   /* number of partitions (0: not partitioned) */
+  strm_stream* part[0];
+};
+
+/* partial table for partitioned reduce_by_key */
+struct rbk_part {
+  khash_t(rbk) *tbl;
+  strm_stream* rbk;
 };
 
 static int
-iter_rbk(strm_stream* strm, strm_value data)
+rbk_put(strm_stream* strm, khash_t(rbk) *tbl, strm_value func, strm_value k, strm_value v)
 {
-  struct rbk_data *d = strm->data;
-  strm_value k, v;
   khiter_t i;
   int r;
 
-  if (!strm_array_p(data) || strm_ary_len(data) != 2) {
-    strm_raise(strm, "reduce_by_key element must be a key-value pair");
-    return STRM_NG;
-  }
-  k = strm_ary_ptr(data)[0];
-  v = strm_ary_ptr(data)[1];
-
-  i = kh_put(rbk, d->tbl, k, &r);
+  i = kh_put(rbk, tbl, k, &r);
   if (r < 0) {                  /* r<0 operation failed */
     return STRM_NG;
   }
   if (r != 0) {                 /* key does not exist */
-    kh_value(d->tbl, i) = v;
+    kh_value(tbl, i) = v;
   }
   else {
     strm_value args[3];
 
     args[0] = k;
-    args[1] = kh_value(d->tbl, i);
+    args[1] = kh_value(tbl, i);
     args[2] = v;
-    if (strm_funcall(strm, d->func, 3, args, &v) == STRM_NG) {
+    if (strm_funcall(strm, func, 3, args, &v) == STRM_NG) {
       return STRM_NG;
     }
-    kh_value(d->tbl, i) = v;
+    kh_value(tbl, i) = v;
   }
   return STRM_OK;
 }
 
 static int
-rbk_finish(strm_stream* strm, strm_value data)
+rbk_part_exec(strm_stream* strm, strm_value data)
+{
+  struct rbk_part* p = strm->data;
+  struct rbk_data* d = p->rbk->data;
+  int n;
+
+  n = rbk_put(strm, p->tbl, d->func, strm_ary_ptr(data)[0], strm_ary_ptr(data)[1]);
+  /* release reference taken in iter_rbk() */
+  strm_stream_close(p->rbk);
+  return n;
+}
+
+static int
+rbk_part_close(strm_stream* strm, strm_value data)
+{
+  struct rbk_part* p = strm->data;
+
+  kh_destroy(rbk, p->tbl);
+  free(p);
+  return STRM_OK;
+}
+
+static int
+rbk_part_init(strm_stream* strm, struct rbk_data* d)
+{
+  strm_int i;
+
+  for (i=0; i<d->n; i++) {
+    struct rbk_part* p = malloc(sizeof(*p));
+
+    if (!p) return STRM_NG;
+    p->tbl = kh_init(rbk);
+    if (!p->tbl) {
+      free(p);
+      return STRM_NG;
+    }
+    p->rbk = strm;
+    d->part[i] = strm_stream_new(strm_filter, rbk_part_exec, rbk_part_close, (void*)p);
+  }
+  return STRM_OK;
+}
+
+static int
+iter_rbk(strm_stream* strm, strm_value data)
 {
   struct rbk_data *d = strm->data;
+  strm_int i;
+
+  if (!strm_array_p(data) || strm_ary_len(data) != 2) {
+    strm_raise(strm, "reduce_by_key element must be a key-value pair");
+    return STRM_NG;
+  }
+  if (d->n == 0) {
+    return rbk_put(strm, d->tbl, d->func, strm_ary_ptr(data)[0], strm_ary_ptr(data)[1]);
+  }
+  if (d->part[0] == NULL) {
+    if (rbk_part_init(strm, d) == STRM_NG) return STRM_NG;
+  }
+  /* keep the stream open until the partition consumes the pair */
+  strm_atomic_inc(strm->refcnt);
+  /* partition by key; upper bits of the hash, since the lower bits
+     are used by the partition table */
+  i = (strm_value_hash(strm_ary_ptr(data)[0]) >> 32) % d->n;
+  strm_task_push(d->part[i], rbk_part_exec, data);
+  return STRM_OK;
+}
+
+static void
+rbk_emit(strm_stream* strm, khash_t(rbk) *tbl)
+{
   khiter_t i;
 
-  for (i=kh_begin(d->tbl); i!=kh_end(d->tbl); i++) {
-    if (kh_exist(d->tbl, i)) {
+  for (i=kh_begin(tbl); i!=kh_end(tbl); i++) {
+    if (kh_exist(tbl, i)) {
       strm_value values[2];
 
-      values[0] = kh_key(d->tbl, i);
-      values[1] = kh_value(d->tbl, i);
+      values[0] = kh_key(tbl, i);
+      values[1] = kh_value(tbl, i);
       strm_emit(strm, strm_ary_new(values, 2), NULL);
     }
   }
+}
+
+static int
+rbk_finish(strm_stream* strm, strm_value data)
+{
+  struct rbk_data *d = strm->data;
+  strm_int j;
+
+  /* partitions have disjoint keys; no need to merge */
+  for (j=0; j<d->n && d->part[j]; j++) {
+    struct rbk_part* p = d->part[j]->data;
+
+    rbk_emit(strm, p->tbl);
+    strm_task_push(d->part[j], (strm_callback)strm_stream_close, strm_nil_value());
+  }
+  rbk_emit(strm, d->tbl);
   return STRM_OK;
 }
 
@@ -619,13 +921,25 @@ exec_rbk(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   struct rbk_data *d;
   khash_t(rbk) *t;
   strm_value func;
+  strm_int n = 0;
 
-  strm_get_args(strm, argc, args, "v", &func);
+  if (argc == 1) {
+    strm_get_args(strm, argc, args, "v", &func);
+  }
+  else {
+    strm_get_args(strm, argc, args, "iv", &n, &func);
+    if (n <= 0) {
+      strm_raise(strm, "invalid number of partitions");
+      return STRM_NG;
+    }
+  }
   t = kh_init(rbk);
   if (!t) return STRM_NG;
-  d = malloc(sizeof(*d));
+  d = malloc(sizeof(*d)+sizeof(strm_stream*)*n);
   d->tbl = t;
   d->func = func;
+  d->n = n;
+  memset(d->part, 0, sizeof(strm_stream*)*n);
   *ret = strm_stream_value(strm_stream_new(strm_filter, iter_rbk, rbk_finish, (void*)d));
   return STRM_OK;
 }
@@ -686,30 +1000,21 @@ exec_slice(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return STRM_OK;
 }
 
+/* buf has 2n slots; each value is stored twice (at i and i+n) so that
+   the last n values are always contiguous */
 static int
 iter_consec(strm_stream* strm, strm_value data)
 {
   struct slice_data* d = strm->data;
   strm_int n = d->n;
+  strm_int p = d->i % n;
 
-  if (d->i < n) {
-    d->buf[d->i++] = data;
-    if (d->i == n) {
-      strm_array ary = strm_ary_new(d->buf, n);
-      strm_emit(strm, strm_ary_value(ary), NULL);
-    }
-    return STRM_OK;
-  }
-  else {
-    strm_array ary;
-    strm_int i;
-    strm_int len = n-1;
+  d->buf[p] = d->buf[p+n] = data;
+  d->i++;
+  if (d->i >= n) {
+    strm_array ary = strm_ary_new(&d->buf[p+1], n);
 
-    for (i=0; i<len; i++) {
-      d->buf[i] = d->buf[i+1];
-    }
-    d->buf[len] = data;
-    ary = strm_ary_new(d->buf, n);
+    if (d->i == n*2) d->i = n;
     strm_emit(strm, strm_ary_value(ary), NULL);
   }
   return STRM_OK;
@@ -732,11 +1037,15 @@ exec_consec(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   strm_int n;
 
   strm_get_args(strm, argc, args, "i", &n);
+  if (n <= 0) {
+    strm_raise(strm, "invalid size");
+    return STRM_NG;
+  }
   d = malloc(sizeof(*d));
   if (!d) return STRM_NG;
   d->n = n;
   d->i = 0;
-  d->buf = malloc(n*sizeof(strm_value));
+  d->buf = malloc(n*2*sizeof(strm_value));
   if (!d->buf) {
     free(d);
     return STRM_NG;
@@ -745,6 +1054,328 @@ exec_consec(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return STRM_OK;
 }
 
+/* time based windows: records are grouped by timestamps and emitted
+   as [start, [record, ...]] when the watermark (max timestamp - lateness)
+   passes the end of the window; records for closed windows are dropped.
+   start is a time if timestamps are times, a number otherwise */
+enum window_type {
+  window_tumbling,
+  window_sliding,
+  window_session,
+};
+
+struct window_buf {
+  double start;
+  double end;                   /* last timestamp for session windows */
+  strm_int len;
+  strm_int capa;
+  strm_value* v;
+};
+
+struct window_data {
+  enum window_type type;
+  double size;                  /* gap for session windows */
+  double slide;
+  double lateness;
+  double maxts;
+  strm_int started;
+  strm_int time_p;              /* timestamps are times */
+  int utc_offset;               /* of the last time */
+  strm_value func;
+  strm_int n;
+  strm_int capa;
+  struct window_buf* w;         /* open windows sorted by start */
+};
+
+static int
+window_add(struct window_buf* w, strm_value v)
+{
+  if (w->len == w->capa) {
+    strm_int capa = w->capa ? w->capa*2 : 16;
+    strm_value* p = realloc(w->v, sizeof(strm_value)*capa);
+
+    if (!p) return STRM_NG;
+    w->v = p;
+    w->capa = capa;
+  }
+  w->v[w->len++] = v;
+  return STRM_OK;
+}
+
+/* open a new window at i */
+static struct window_buf*
+window_insert(struct window_data* d, strm_int i, double start, double end)
+{
+  struct window_buf* w;
+
+  if (d->n == d->capa) {
+    strm_int capa = d->capa ? d->capa*2 : 8;
+    struct window_buf* p = realloc(d->w, sizeof(struct window_buf)*capa);
+
+    if (!p) return NULL;
+    d->w = p;
+    d->capa = capa;
+  }
+  memmove(&d->w[i+1], &d->w[i], sizeof(struct window_buf)*(d->n-i));
+  d->n++;
+  w = &d->w[i];
+  w->start = start;
+  w->end = end;
+  w->len = w->capa = 0;
+  w->v = NULL;
+  return w;
+}
+
+/* window starting at start; searched from the newest */
+static struct window_buf*
+window_get(struct window_data* d, double start)
+{
+  strm_int i;
+
+  for (i=d->n; i>0; i--) {
+    if (d->w[i-1].start == start) return &d->w[i-1];
+    if (d->w[i-1].start < start) break;
+  }
+  return window_insert(d, i, start, start+d->size);
+}
+
+static int
+window_session_add(struct window_data* d, double ts, strm_value data)
+{
+  double gap = d->size;
+  struct window_buf* w;
+  strm_int i;
+
+  for (i=0; i<d->n; i++) {
+    w = &d->w[i];
+    if (ts < w->start - gap) break;
+    if (ts < w->end + gap) {    /* extend the session */
+      if (ts < w->start) w->start = ts;
+      if (ts > w->end) w->end = ts;
+      /* merge following sessions within the gap */
+      while (i+1 < d->n && d->w[i+1].start < w->end + gap) {
+        struct window_buf* w2 = &d->w[i+1];
+        strm_int j;
+
+        for (j=0; j<w2->len; j++) {
+          if (window_add(w, w2->v[j]) == STRM_NG) return STRM_NG;
+        }
+        if (w2->end > w->end) w->end = w2->end;
+        free(w2->v);
+        memmove(w2, w2+1, sizeof(struct window_buf)*(d->n-i-2));
+        d->n--;
+      }
+      return window_add(w, data);
+    }
+  }
+  if (ts + gap <= d->maxts - d->lateness) return STRM_OK; /* late */
+  w = window_insert(d, i, ts, ts);
+  if (!w) return STRM_NG;
+  return window_add(w, data);
+}
+
+static void
+window_emit(strm_stream* strm, struct window_data* d, struct window_buf* w)
+{
+  strm_value buf[2];
+
+  if (d->time_p) {
+    double sec = floor(w->start);
+    long usec = (long)((w->start - sec)*1000000.0 + 0.5);
+
+    if (usec >= 1000000) {
+      sec += 1;
+      usec -= 1000000;
+    }
+    buf[0] = strm_time_new((long)sec, usec, d->utc_offset);
+  }
+  else {
+    buf[0] = strm_float_value(w->start);
+  }
+  buf[1] = strm_ary_value(strm_ary_new(w->v, w->len));
+  free(w->v);
+  strm_emit(strm, strm_ary_value(strm_ary_new(buf, 2)), NULL);
+}
+
+static int
+window_closed_p(struct window_data* d, struct window_buf* w, double wm)
+{
+  if (d->type == window_session) {
+    return w->end + d->size <= wm;
+  }
+  return w->end <= wm;
+}
+
+static int
+iter_window(strm_stream* strm, strm_value data)
+{
+  struct window_data* d = strm->data;
+  strm_value t;
+  double ts, wm;
+  strm_int i, j;
+
+  if (!strm_nil_p(d->func)) {
+    if (strm_funcall(strm, d->func, 1, &data, &t) == STRM_NG) {
+      return STRM_NG;
+    }
+  }
+  else if (strm_array_p(data) && strm_ary_len(data) > 0) {
+    t = strm_ary_ptr(data)[0];
+  }
+  else {
+    t = strm_nil_value();
+  }
+  if (strm_time_p(t)) {
+    ts = strm_time_float(t);
+    d->time_p = TRUE;
+    d->utc_offset = strm_time_offset(t);
+  }
+  else if (strm_number_p(t)) {
+    ts = strm_value_float(t);
+  }
+  else {
+    strm_raise(strm, "window requires timestamp");
+    return STRM_NG;
+  }
+  if (!d->started || ts > d->maxts) {
+    d->maxts = ts;
+    d->started = TRUE;
+  }
+  wm = d->maxts - d->lateness;
+
+  switch (d->type) {
+  case window_tumbling:
+    {
+      double start = floor(ts / d->size) * d->size;
+      struct window_buf* w;
+
+      if (start + d->size <= wm) break; /* late */
+      w = window_get(d, start);
+      if (!w || window_add(w, data) == STRM_NG) return STRM_NG;
+    }
+    break;
+  case window_sliding:
+    {
+      double start = floor(ts / d->slide) * d->slide;
+
+      /* ts belongs to windows [start, start+size) for start > ts-size */
+      for (; start > ts - d->size; start -= d->slide) {
+        struct window_buf* w;
+
+        if (start + d->size <= wm) break; /* late */
+        w = window_get(d, start);
+        if (!w || window_add(w, data) == STRM_NG) return STRM_NG;
+      }
+    }
+    break;
+  case window_session:
+    if (window_session_add(d, ts, data) == STRM_NG) return STRM_NG;
+    break;
+  }
+
+  /* emit closed windows */
+  for (i=0,j=0; i<d->n; i++) {
+    if (window_closed_p(d, &d->w[i], wm)) {
+      window_emit(strm, d, &d->w[i]);
+    }
+    else {
+      d->w[j++] = d->w[i];
+    }
+  }
+  d->n = j;
+  return STRM_OK;
+}
+
+static int
+finish_window(strm_stream* strm, strm_value data)
+{
+  struct window_data* d = strm->data;
+  strm_int i;
+
+  for (i=0; i<d->n; i++) {
+    window_emit(strm, d, &d->w[i]);
+  }
+  free(d->w);
+  free(d);
+  return STRM_OK;
+}
+
+/*
+  window("tumbling", size[, lateness][, func])
+  window("sliding", size, slide[, lateness][, func])
+  window("session", gap[, lateness][, func])
+
+  func takes a record and returns its timestamp (time or number of
+  seconds); without func, the first element of a record is used.
+*/
+static int
+exec_window(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  struct window_data* d;
+  enum window_type type;
+  strm_string name;
+  double num[3];
+  strm_int nnum = 0;
+  strm_value func = strm_nil_value();
+  strm_int i;
+
+  if (argc < 2) {
+    strm_raise(strm, "wrong number of arguments");
+    return STRM_NG;
+  }
+  strm_get_args(strm, 1, args, "S", &name);
+  if (strm_str_eq(name, strm_str_lit("tumbling"))) {
+    type = window_tumbling;
+  }
+  else if (strm_str_eq(name, strm_str_lit("sliding"))) {
+    type = window_sliding;
+  }
+  else if (strm_str_eq(name, strm_str_lit("session"))) {
+    type = window_session;
+  }
+  else {
+    strm_raise(strm, "unknown window type");
+    return STRM_NG;
+  }
+  for (i=1; i<argc; i++) {
+    if (strm_number_p(args[i]) && nnum < 3) {
+      num[nnum++] = strm_value_float(args[i]);
+    }
+    else if (i == argc-1 && !strm_number_p(args[i])) {
+      func = args[i];
+    }
+    else {
+      strm_raise(strm, "wrong number of arguments");
+      return STRM_NG;
+    }
+  }
+  if (nnum < (type == window_sliding ? 2 : 1) ||
+      nnum > (type == window_sliding ? 3 : 2)) {
+    strm_raise(strm, "wrong number of arguments");
+    return STRM_NG;
+  }
+  d = malloc(sizeof(*d));
+  if (!d) return STRM_NG;
+  d->type = type;
+  d->size = num[0];
+  d->slide = (type == window_sliding) ? num[1] : num[0];
+  d->lateness = (nnum > (type == window_sliding ? 2 : 1)) ? num[nnum-1] : 0;
+  if (d->size <= 0 || d->slide <= 0 || d->lateness < 0) {
+    strm_raise(strm, "invalid window size");
+    free(d);
+    return STRM_NG;
+  }
+  d->maxts = 0;
+  d->started = FALSE;
+  d->time_p = FALSE;
+  d->utc_offset = 0;
+  d->func = func;
+  d->n = d->capa = 0;
+  d->w = NULL;
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_window, finish_window, (void*)d));
+  return STRM_OK;
+}
+
 struct take_data {
   int n;
 };
@@ -886,6 +1517,7 @@ strm_iter_init(strm_state* state)
   strm_var_def(state, "cycle", strm_cfunc_value(exec_cycle));
   strm_var_def(state, "each", strm_cfunc_value(exec_each));
   strm_var_def(state, "map", strm_cfunc_value(exec_map));
+  strm_var_def(state, "pmap", strm_cfunc_value(exec_pmap));
   strm_var_def(state, "flatmap", strm_cfunc_value(exec_flatmap));
   strm_var_def(state, "filter", strm_cfunc_value(exec_filter));
   strm_var_def(state, "count", strm_cfunc_value(exec_count));
@@ -896,6 +1528,7 @@ strm_iter_init(strm_state* state)
 
   strm_var_def(state, "slice", strm_cfunc_value(exec_slice));
   strm_var_def(state, "consec", strm_cfunc_value(exec_consec));
+  strm_var_def(state, "window", strm_cfunc_value(exec_window));
   strm_var_def(state, "take", strm_cfunc_value(exec_take));
   strm_var_def(state, "drop", strm_cfunc_value(exec_drop));
   strm_var_def(state, "uniq", strm_cfunc_value(exec_uniq));
@@ -0,0 +1,201 @@
+#include "strm.h"
+#include "atomic.h"
+
+/* parallel aggregation: records are dealt to partitions, each of them
+   running a copy of the aggregation stage; partial states are merged
+   when the input is closed */
+
+#ifndef PARALLEL_BATCH
+#define PARALLEL_BATCH 256
+#endif
+
+#define MERGER_MAX 32
+
+static const struct strm_merger* mergers[MERGER_MAX];
+static int nmergers = 0;
+
+void
+strm_merger_def(const struct strm_merger* m)
+{
+  if (nmergers < MERGER_MAX) {
+    mergers[nmergers++] = m;
+  }
+}
+
+static const struct strm_merger*
+merger_get(strm_callback start)
+{
+  int i;
+
+  for (i=0; i<nmergers; i++) {
+    if (mergers[i]->start == start) return mergers[i];
+  }
+  return NULL;
+}
+
+struct par_batch {
+  strm_stream* par;
+  strm_int n;
+  strm_value v[PARALLEL_BATCH];
+};
+
+struct par_data {
+  const struct strm_merger* m;
+  void* data;                   /* state of the stage itself */
+  strm_callback close;          /* finish function of the stage */
+  struct par_batch* batch;
+  strm_int i;
+  strm_int n;
+  strm_stream* part[0];
+};
+
+static int
+par_part_exec(strm_stream* strm, strm_value data)
+{
+  struct par_batch* b = strm_value_foreign(data);
+  struct par_data* d = b->par->data;
+  strm_int i;
+  int n = STRM_OK;
+
+  for (i=0; i<b->n; i++) {
+    n = (*d->m->start)(strm, b->v[i]);
+    if (n == STRM_NG) break;
+  }
+  /* release reference taken in par_deal() */
+  strm_stream_close(b->par);
+  free(b);
+  return n;
+}
+
+static struct par_batch*
+par_batch_new(strm_stream* strm)
+{
+  struct par_batch* b = malloc(sizeof(struct par_batch));
+
+  if (!b) return NULL;
+  b->par = strm;
+  b->n = 0;
+  return b;
+}
+
+static int
+par_deal(strm_stream* strm, strm_value data)
+{
+  struct par_data* d = strm->data;
+  struct par_batch* b = d->batch;
+
+  b->v[b->n++] = data;
+  if (b->n < PARALLEL_BATCH) return STRM_OK;
+
+  d->batch = par_batch_new(strm);
+  if (!d->batch) {
+    d->batch = b;
+    b->n = 0;
+    return STRM_NG;
+  }
+  /* keep the stream open until the partition consumes the batch */
+  strm_atomic_inc(strm->refcnt);
+  strm_task_push(d->part[d->i], par_part_exec, strm_foreign_value(b));
+  d->i = (d->i+1) % d->n;
+  return STRM_OK;
+}
+
+static int
+par_finish(strm_stream* strm, strm_value data)
+{
+  struct par_data* d = strm->data;
+  struct par_batch* b = d->batch;
+  strm_callback close = d->close;
+  strm_int i;
+
+  /* restore the stage, feed the rest of records, and merge partitions;
+     all batches have been consumed since they hold references */
+  strm->data = d->data;
+  strm->start_func = d->m->start;
+  strm->close_func = close;
+  for (i=0; i<b->n; i++) {
+    if ((*d->m->start)(strm, b->v[i]) == STRM_NG) break;
+  }
+  free(b);
+  for (i=0; i<d->n; i++) {
+    strm_stream* part = d->part[i];
+
+    (*d->m->merge)(strm->data, part->data);
+    part->data = NULL;
+    strm_task_push(part, (strm_callback)strm_stream_close, strm_nil_value());
+  }
+  free(d);
+  if (close) {
+    return (*close)(strm, data);
+  }
+  return STRM_OK;
+}
+
+/* parallel(n, stage): run aggregation stage in n partitions, e.g.
+     seq(1000000) | parallel(4, quantile(0.5, 0.99)) | stdout
+   the stage should be mergeable (count_distinct, top_k, quantile,
+   stdev, correl, etc.) */
+static int
+exec_parallel(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  strm_int n;
+  strm_value v;
+  strm_stream* s;
+  const struct strm_merger* m;
+  struct par_data* d;
+  strm_int i;
+
+  strm_get_args(strm, argc, args, "iv", &n, &v);
+  if (n <= 0) {
+    strm_raise(strm, "invalid number of partitions");
+    return STRM_NG;
+  }
+  if (!strm_stream_p(v)) {
+    strm_raise(strm, "stage required");
+    return STRM_NG;
+  }
+  s = strm_value_stream(v);
+  m = merger_get(s->start_func);
+  if (!m) {
+    strm_raise(strm, "stage not mergeable");
+    return STRM_NG;
+  }
+  d = malloc(sizeof(struct par_data)+sizeof(strm_stream*)*n);
+  if (!d) return STRM_NG;
+  d->batch = par_batch_new(s);
+  if (!d->batch) {
+    free(d);
+    return STRM_NG;
+  }
+  d->m = m;
+  d->data = s->data;
+  d->close = s->close_func;
+  d->i = 0;
+  d->n = n;
+  for (i=0; i<n; i++) {
+    void* p = (*m->clone)(s->data);
+
+    if (!p) {
+      while (i--) {
+        (*m->merge)(s->data, d->part[i]->data);
+        d->part[i]->data = NULL;
+        strm_stream_close(d->part[i]);
+      }
+      free(d->batch);
+      free(d);
+      return STRM_NG;
+    }
+    d->part[i] = strm_stream_new(strm_filter, m->start, NULL, p);
+  }
+  s->data = d;
+  s->start_func = par_deal;
+  s->close_func = par_finish;
+  *ret = v;
+  return STRM_OK;
+}
+
+void
+strm_parallel_init(strm_state* state)
+{
+  strm_var_def(state, "parallel", strm_cfunc_value(exec_parallel));
+}
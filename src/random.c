@@ -4,6 +4,7 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <math.h>
+#include "khash.h"
 
 
 static void
@@ -71,6 +72,31 @@ rand_float(uint32_t seed[4])
   return xorshift128(seed)*(1.0/4294967295.0);
 }
 
+/* uniform double in the open interval (0,1) */
+static double
+rand_open(uint32_t seed[4])
+{
+  return (xorshift128(seed)+0.5)*(1.0/4294967296.0);
+}
+
+/* unbiased integer in [0,n) (Lemire's multiply-shift rejection) */
+static uint32_t
+rand_uniform(uint32_t seed[4], uint32_t n)
+{
+  uint64_t m = (uint64_t)xorshift128(seed) * n;
+  uint32_t l = (uint32_t)m;
+
+  if (l < n) {
+    uint32_t t = -n % n;
+
+    while (l < t) {
+      m = (uint64_t)xorshift128(seed) * n;
+      l = (uint32_t)m;
+    }
+  }
+  return m >> 32;
+}
+
 struct rand_data {
   uint32_t seed[4];
 };
@@ -186,28 +212,55 @@ exec_rnorm(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return STRM_OK;
 }
 
+/* reservoir sampling using Algorithm L; the random generator is
+   called only when a record is going to be taken */
+struct reservoir {
+  strm_int len;                 /* number of filled slots */
+  uint64_t skip;                /* records to skip before the next take */
+  double w;
+  strm_value samples[0];
+};
+
+static void
+reservoir_skip(struct reservoir* r, uint32_t seed[4])
+{
+  double s = floor(log(rand_open(seed))/log1p(-r->w));
+
+  r->skip = (s < (double)UINT64_MAX) ? (uint64_t)s : UINT64_MAX;
+}
+
+static void
+reservoir_add(struct reservoir* r, strm_int k, uint32_t seed[4], strm_value data)
+{
+  if (r->len < k) {
+    r->samples[r->len++] = data;
+    if (r->len == k) {
+      r->w = exp(log(rand_open(seed))/k);
+      reservoir_skip(r, seed);
+    }
+    return;
+  }
+  if (r->skip > 0) {
+    r->skip--;
+    return;
+  }
+  r->samples[rand_uniform(seed, k)] = data;
+  r->w *= exp(log(rand_open(seed))/k);
+  reservoir_skip(r, seed);
+}
+
 struct sample_data {
   uint32_t seed[4];
-  strm_int i;
-  strm_int len;
-  strm_value samples[0];
+  strm_int k;
+  struct reservoir r;           /* must be last */
 };
 
 static int
 iter_sample(strm_stream* strm, strm_value data)
 {
   struct sample_data* d = strm->data;
-  uint32_t r;
 
-  if (d->i < d->len) {
-    d->samples[d->i++] = data;
-    return STRM_OK;
-  }
-  r = xorshift128(d->seed)%(d->i);
-  if (r < d->len) {
-    d->samples[r] = data;
-  }
-  d->i++;
+  reservoir_add(&d->r, d->k, d->seed, data);
   return STRM_OK;
 }
 
@@ -215,10 +268,105 @@ static int
 finish_sample(strm_stream* strm, strm_value data)
 {
   struct sample_data* d = strm->data;
-  strm_int i, len=d->len;
+  strm_int i, len=d->r.len;
 
   for (i=0; i<len; i++) {
-    strm_emit(strm, d->samples[i], NULL);
+    strm_emit(strm, d->r.samples[i], NULL);
+  }
+  free(d);
+  return STRM_OK;
+}
+
+/* weighted reservoir sampling (Efraimidis-Spirakis A-ExpJ); keys are
+   kept in log space, log(u)/w, in a min-heap */
+struct wsample_item {
+  double key;
+  strm_value v;
+};
+
+struct wsample_data {
+  uint32_t seed[4];
+  strm_value func;
+  strm_int k;
+  strm_int len;
+  double x;                     /* weight to skip before the next take */
+  struct wsample_item heap[0];
+};
+
+static void
+wsample_down(struct wsample_item* h, strm_int len, strm_int i)
+{
+  for (;;) {
+    strm_int l = 2*i+1, r = l+1, m = i;
+    struct wsample_item t;
+
+    if (l < len && h[l].key < h[m].key) m = l;
+    if (r < len && h[r].key < h[m].key) m = r;
+    if (m == i) break;
+    t = h[i]; h[i] = h[m]; h[m] = t;
+    i = m;
+  }
+}
+
+static void
+wsample_up(struct wsample_item* h, strm_int i)
+{
+  while (i > 0) {
+    strm_int p = (i-1)/2;
+    struct wsample_item t;
+
+    if (h[p].key <= h[i].key) break;
+    t = h[i]; h[i] = h[p]; h[p] = t;
+    i = p;
+  }
+}
+
+static int
+iter_wsample(strm_stream* strm, strm_value data)
+{
+  struct wsample_data* d = strm->data;
+  strm_value v;
+  double w, tw;
+
+  if (strm_funcall(strm, d->func, 1, &data, &v) == STRM_NG) {
+    return STRM_NG;
+  }
+  if (!strm_number_p(v)) {
+    strm_raise(strm, "weight must be a number");
+    return STRM_NG;
+  }
+  w = strm_value_float(v);
+  if (!(w > 0)) return STRM_OK;   /* never sampled */
+
+  if (d->len < d->k) {
+    d->heap[d->len].key = log(rand_open(d->seed))/w;
+    d->heap[d->len].v = data;
+    wsample_up(d->heap, d->len);
+    d->len++;
+    if (d->len == d->k) {
+      d->x = log(rand_open(d->seed))/d->heap[0].key;
+    }
+    return STRM_OK;
+  }
+  d->x -= w;
+  if (d->x > 0) return STRM_OK;
+  /* draw the new key from (T^w, 1) where T is the current threshold */
+  tw = exp(d->heap[0].key * w);
+  d->heap[0].key = log(tw + (1-tw)*rand_open(d->seed))/w;
+  d->heap[0].v = data;
+  wsample_down(d->heap, d->len, 0);
+  d->x = log(rand_open(d->seed))/d->heap[0].key;
+  return STRM_OK;
+}
+
+static int
+finish_wsample(strm_stream* strm, strm_value data)
+{
+  struct wsample_data* d = strm->data;
+  strm_int i;
+
+  for (i=0; i<d->len; i++) {
+    strm_emit(strm, d->heap[i].v, NULL);
   }
   free(d);
   return STRM_OK;
@@ -227,17 +375,126 @@ finish_sample(strm_stream* strm, strm_value data)
 static int
 exec_sample(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 {
-  struct sample_data* d;
-  strm_int len;
+  strm_int k;
+  strm_value func;
+
+  strm_get_args(strm, argc, args, "i|v", &k, &func);
+  if (k <= 0) {
+    strm_raise(strm, "sample size must be positive");
+    return STRM_NG;
+  }
+  if (argc == 1) {
+    struct sample_data* d;
+
+    d = malloc(sizeof(struct sample_data)+sizeof(strm_value)*k);
+    if (!d) return STRM_NG;
+    d->k = k;
+    d->r.len = 0;
+    xorshift128init(d->seed);
+    *ret = strm_stream_value(strm_stream_new(strm_filter, iter_sample,
+                                             finish_sample, (void*)d));
+  }
+  else {
+    struct wsample_data* d;
+
+    d = malloc(sizeof(struct wsample_data)+sizeof(struct wsample_item)*k);
+    if (!d) return STRM_NG;
+    d->func = func;
+    d->k = k;
+    d->len = 0;
+    xorshift128init(d->seed);
+    *ret = strm_stream_value(strm_stream_new(strm_filter, iter_wsample,
+                                             finish_wsample, (void*)d));
+  }
+  return STRM_OK;
+}
+
+/* stratified sampling: a reservoir of k records per key; keys are
+   compared by content, so that equal strings are one stratum */
+#define strat_hash(v) (khint32_t)strm_value_hash(v)
+KHASH_INIT(strat, strm_value, struct reservoir*, 1, strat_hash, strm_value_eq);
 
-  strm_get_args(strm, argc, args, "i", &len);
-  d = malloc(sizeof(struct sample_data)+sizeof(strm_value)*len);
+struct strat_data {
+  uint32_t seed[4];
+  strm_int k;
+  khash_t(strat) *tbl;
+};
+
+static int
+iter_strat(strm_stream* strm, strm_value data)
+{
+  struct strat_data* d = strm->data;
+  struct reservoir* r;
+  khiter_t i;
+  int st;
+
+  if (!strm_array_p(data) || strm_ary_len(data) != 2) {
+    strm_raise(strm, "sample_by_key element must be a key-value pair");
+    return STRM_NG;
+  }
+  i = kh_get(strat, d->tbl, strm_ary_ptr(data)[0]);
+  if (i == kh_end(d->tbl)) {    /* new key */
+    r = malloc(sizeof(struct reservoir)+sizeof(strm_value)*d->k);
+    if (!r) return STRM_NG;
+    r->len = 0;
+    i = kh_put(strat, d->tbl, strm_ary_ptr(data)[0], &st);
+    if (st < 0) {
+      free(r);
+      return STRM_NG;
+    }
+    kh_value(d->tbl, i) = r;
+  }
+  else {
+    r = kh_value(d->tbl, i);
+  }
+  reservoir_add(r, d->k, d->seed, strm_ary_ptr(data)[1]);
+  return STRM_OK;
+}
+
+static int
+finish_strat(strm_stream* strm, strm_value data)
+{
+  struct strat_data* d = strm->data;
+  khiter_t i;
+
+  for (i=kh_begin(d->tbl); i!=kh_end(d->tbl); i++) {
+    if (kh_exist(d->tbl, i)) {
+      struct reservoir* r = kh_value(d->tbl, i);
+      strm_value pair[2];
+
+      pair[0] = kh_key(d->tbl, i);
+      pair[1] = strm_ary_new(r->samples, r->len);
+      strm_emit(strm, strm_ary_new(pair, 2), NULL);
+      free(r);
+    }
+  }
+  kh_destroy(strat, d->tbl);
+  free(d);
+  return STRM_OK;
+}
+
+static int
+exec_sample_by_key(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  struct strat_data* d;
+  strm_int k;
+
+  strm_get_args(strm, argc, args, "i", &k);
+  if (k <= 0) {
+    strm_raise(strm, "sample size must be positive");
+    return STRM_NG;
+  }
+  d = malloc(sizeof(struct strat_data));
   if (!d) return STRM_NG;
-  d->len = len;
-  d->i = 0;
+  d->tbl = kh_init(strat);
+  if (!d->tbl) {
+    free(d);
+    return STRM_NG;
+  }
+  d->k = k;
   xorshift128init(d->seed);
-  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_sample,
-                                           finish_sample, (void*)d));
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_strat,
+                                           finish_strat, (void*)d));
   return STRM_OK;
 }
 
@@ -248,4 +505,5 @@ strm_rand_init(strm_state* state)
   strm_var_def(state, "rand", strm_cfunc_value(exec_rand));
   strm_var_def(state, "rand_norm", strm_cfunc_value(exec_rnorm));
   strm_var_def(state, "sample", strm_cfunc_value(exec_sample));
+  strm_var_def(state, "sample_by_key", strm_cfunc_value(exec_sample_by_key));
 }
@@ -0,0 +1,669 @@
+#include "strm.h"
+#include <math.h>
+
+static inline uint64_t
+fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/* count_distinct: HyperLogLog with 2^p registers; sketches can be
+   merged by taking the maximum of each register */
+#ifndef HLL_PRECISION
+#define HLL_PRECISION 14
+#endif
+
+struct hll_data {
+  int p;
+  strm_int m;
+  uint8_t reg[0];
+};
+
+static int
+iter_hll(strm_stream* strm, strm_value data)
+{
+  struct hll_data* d = strm->data;
+  uint64_t h = strm_value_hash(data);
+  uint64_t idx = h >> (64 - d->p);
+  uint64_t w = (h << d->p) | ((uint64_t)1 << (d->p - 1));
+  uint8_t rank = __builtin_clzll(w) + 1;
+
+  if (d->reg[idx] < rank) {
+    d->reg[idx] = rank;
+  }
+  return STRM_OK;
+}
+
+static double
+hll_estimate(struct hll_data* d)
+{
+  double m = d->m;
+  double alpha, sum = 0, e;
+  strm_int i, zeros = 0;
+
+  switch (d->m) {
+  case 16: alpha = 0.673; break;
+  case 32: alpha = 0.697; break;
+  case 64: alpha = 0.709; break;
+  default: alpha = 0.7213/(1 + 1.079/m); break;
+  }
+  for (i=0; i<d->m; i++) {
+    sum += ldexp(1.0, -d->reg[i]);
+    if (d->reg[i] == 0) zeros++;
+  }
+  e = alpha * m * m / sum;
+  if (e <= 2.5 * m && zeros > 0) {
+    /* small range correction (linear counting) */
+    e = m * log(m / zeros);
+  }
+  return e;
+}
+
+static int
+finish_hll(strm_stream* strm, strm_value data)
+{
+  struct hll_data* d = strm->data;
+
+  strm_emit(strm, strm_int_value((strm_int)round(hll_estimate(d))), NULL);
+  free(d);
+  return STRM_OK;
+}
+
+static void*
+hll_clone(void* data)
+{
+  struct hll_data* d = data;
+  struct hll_data* d2 = malloc(sizeof(struct hll_data)+d->m);
+
+  if (!d2) return NULL;
+  d2->p = d->p;
+  d2->m = d->m;
+  memset(d2->reg, 0, d->m);
+  return d2;
+}
+
+static void
+hll_merge(void* data, void* part)
+{
+  struct hll_data* d = data;
+  struct hll_data* p = part;
+  strm_int i;
+
+  for (i=0; i<d->m; i++) {
+    if (d->reg[i] < p->reg[i]) d->reg[i] = p->reg[i];
+  }
+  free(p);
+}
+
+static const struct strm_merger hll_merger = {
+  iter_hll, hll_clone, hll_merge,
+};
+
+/* count_distinct([precision]) */
+static int
+exec_count_distinct(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  struct hll_data* d;
+  strm_int p = HLL_PRECISION;
+  strm_int m;
+
+  strm_get_args(strm, argc, args, "|i", &p);
+  if (p < 4 || p > 18) {
+    strm_raise(strm, "precision should be 4..18");
+    return STRM_NG;
+  }
+  m = 1 << p;
+  d = malloc(sizeof(struct hll_data)+m);
+  if (!d) return STRM_NG;
+  d->p = p;
+  d->m = m;
+  memset(d->reg, 0, m);
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_hll,
+                                           finish_hll, (void*)d));
+  return STRM_OK;
+}
+
+/* top_k/heavy_hitters: Space-Saving (Metwally et al.) with a fixed
+   number of counters kept in a min-heap; sketches can be merged by
+   adding counters and keeping the largest ones */
+
+struct ss_counter {
+  strm_value v;
+  uint64_t hash;
+  uint64_t count;
+  uint64_t error;
+  strm_int pos;                 /* index in heap */
+};
+
+struct ss_data {
+  strm_int k;                   /* number of results (0 for heavy_hitters) */
+  double phi;                   /* threshold for heavy_hitters */
+  uint64_t total;
+  strm_int n;
+  strm_int capa;
+  strm_int mask;
+  strm_int* tbl;                /* open addressing table: hash -> counter */
+  strm_int* heap;               /* counters ordered by count */
+  struct ss_counter c[0];
+};
+
+static strm_int
+ss_find(struct ss_data* d, uint64_t h)
+{
+  strm_int i = h & d->mask;
+
+  while (d->tbl[i] >= 0) {
+    if (d->c[d->tbl[i]].hash == h) return i;
+    i = (i+1) & d->mask;
+  }
+  return i;
+}
+
+/* remove slot i with backward shift */
+static void
+ss_remove(struct ss_data* d, strm_int i)
+{
+  strm_int j = i;
+
+  for (;;) {
+    strm_int k;
+
+    j = (j+1) & d->mask;
+    if (d->tbl[j] < 0) break;
+    k = d->c[d->tbl[j]].hash & d->mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      d->tbl[i] = d->tbl[j];
+      i = j;
+    }
+  }
+  d->tbl[i] = -1;
+}
+
+static void
+ss_swap(struct ss_data* d, strm_int i, strm_int j)
+{
+  strm_int t = d->heap[i];
+
+  d->heap[i] = d->heap[j];
+  d->heap[j] = t;
+  d->c[d->heap[i]].pos = i;
+  d->c[d->heap[j]].pos = j;
+}
+
+static void
+ss_down(struct ss_data* d, strm_int i)
+{
+  for (;;) {
+    strm_int l = i*2+1;
+    strm_int m = i;
+
+    if (l < d->n && d->c[d->heap[l]].count < d->c[d->heap[m]].count) m = l;
+    if (l+1 < d->n && d->c[d->heap[l+1]].count < d->c[d->heap[m]].count) m = l+1;
+    if (m == i) break;
+    ss_swap(d, i, m);
+    i = m;
+  }
+}
+
+static void
+ss_up(struct ss_data* d, strm_int i)
+{
+  while (i > 0 && d->c[d->heap[(i-1)/2]].count > d->c[d->heap[i]].count) {
+    ss_swap(d, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static int
+iter_ss(strm_stream* strm, strm_value data)
+{
+  struct ss_data* d = strm->data;
+  uint64_t h = strm_value_hash(data);
+  struct ss_counter* c;
+  strm_int i = ss_find(d, h);
+
+  d->total++;
+  if (d->tbl[i] >= 0) {
+    c = &d->c[d->tbl[i]];
+    c->count++;
+    ss_down(d, c->pos);
+    return STRM_OK;
+  }
+  if (d->n < d->capa) {
+    strm_int j = d->n++;
+
+    c = &d->c[j];
+    c->count = 0;
+    c->error = 0;
+    c->pos = j;
+    d->heap[j] = j;
+  }
+  else {
+    /* replace the counter with minimum count */
+    c = &d->c[d->heap[0]];
+    ss_remove(d, ss_find(d, c->hash));
+    c->error = c->count;
+    i = ss_find(d, h);
+  }
+  c->v = data;
+  c->hash = h;
+  c->count++;
+  d->tbl[i] = c - d->c;
+  if (c->count == 1) {
+    ss_up(d, c->pos);
+  }
+  else {
+    ss_down(d, c->pos);
+  }
+  return STRM_OK;
+}
+
+static int
+ss_cmp(const void* a_p, const void* b_p)
+{
+  const struct ss_counter* a = a_p;
+  const struct ss_counter* b = b_p;
+
+  if (a->count < b->count) return 1;
+  if (a->count > b->count) return -1;
+  return 0;
+}
+
+static int
+finish_ss(strm_stream* strm, strm_value data)
+{
+  struct ss_data* d = strm->data;
+  strm_int i, n = d->n;
+
+  qsort(d->c, n, sizeof(struct ss_counter), ss_cmp);
+  if (d->k > 0 && d->k < n) {
+    n = d->k;
+  }
+  for (i=0; i<n; i++) {
+    strm_value buf[2];
+
+    if (d->k == 0 && d->c[i].count < d->phi * d->total) break;
+    buf[0] = d->c[i].v;
+    buf[1] = strm_int_value((strm_int)d->c[i].count);
+    strm_emit(strm, strm_ary_value(strm_ary_new(buf, 2)), NULL);
+  }
+  free(d->tbl);
+  free(d->heap);
+  free(d);
+  return STRM_OK;
+}
+
+static struct ss_data*
+ss_alloc(strm_int k, double phi, strm_int capa)
+{
+  struct ss_data* d;
+  strm_int size = 16;
+  strm_int i;
+
+  while (size < capa*2) size *= 2;
+  d = malloc(sizeof(struct ss_data)+sizeof(struct ss_counter)*capa);
+  if (!d) return NULL;
+  d->k = k;
+  d->phi = phi;
+  d->total = 0;
+  d->n = 0;
+  d->capa = capa;
+  d->mask = size-1;
+  d->tbl = malloc(sizeof(strm_int)*size);
+  d->heap = malloc(sizeof(strm_int)*capa);
+  if (!d->tbl || !d->heap) {
+    free(d->tbl);
+    free(d->heap);
+    free(d);
+    return NULL;
+  }
+  for (i=0; i<size; i++) {
+    d->tbl[i] = -1;
+  }
+  return d;
+}
+
+static int
+ss_new(strm_stream* strm, strm_int k, double phi, strm_int capa, strm_value* ret)
+{
+  struct ss_data* d = ss_alloc(k, phi, capa);
+
+  if (!d) return STRM_NG;
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_ss,
+                                           finish_ss, (void*)d));
+  return STRM_OK;
+}
+
+static void*
+ss_clone(void* data)
+{
+  struct ss_data* d = data;
+
+  return ss_alloc(d->k, d->phi, d->capa);
+}
+
+/* minimum count of a full sketch; an absent value may have been
+   counted up to this */
+static uint64_t
+ss_min(struct ss_data* d)
+{
+  if (d->n < d->capa) return 0;
+  return d->c[d->heap[0]].count;
+}
+
+/* merge counters (Agarwal et al.); counts of values absent from a
+   sketch are bounded by its minimum count, so add it to keep them
+   overestimated, then keep the largest counters */
+static void
+ss_merge(void* data, void* part)
+{
+  struct ss_data* d = data;
+  struct ss_data* p = part;
+  uint64_t dmin = ss_min(d);
+  uint64_t pmin = ss_min(p);
+  struct ss_counter* c = malloc(sizeof(struct ss_counter)*(d->n+p->n));
+  strm_int i, j, n = 0;
+
+  if (!c) goto end;
+  for (i=0; i<d->n; i++) {
+    c[n] = d->c[i];
+    j = ss_find(p, c[n].hash);
+    if (p->tbl[j] >= 0) {
+      struct ss_counter* pc = &p->c[p->tbl[j]];
+
+      c[n].count += pc->count;
+      c[n].error += pc->error;
+      pc->pos = -1;             /* merged */
+    }
+    else {
+      c[n].count += pmin;
+      c[n].error += pmin;
+    }
+    n++;
+  }
+  for (i=0; i<p->n; i++) {
+    if (p->c[i].pos < 0) continue;
+    c[n] = p->c[i];
+    c[n].count += dmin;
+    c[n].error += dmin;
+    n++;
+  }
+  qsort(c, n, sizeof(struct ss_counter), ss_cmp);
+  if (n > d->capa) n = d->capa;
+
+  /* rebuild; counters in ascending order form a heap */
+  for (i=0; i<=d->mask; i++) {
+    d->tbl[i] = -1;
+  }
+  for (i=0; i<n; i++) {
+    d->c[i] = c[i];
+    d->c[i].pos = n-1-i;
+    d->heap[n-1-i] = i;
+    d->tbl[ss_find(d, c[i].hash)] = i;
+  }
+  d->n = n;
+  d->total += p->total;
+  free(c);
+ end:
+  free(p->tbl);
+  free(p->heap);
+  free(p);
+}
+
+static const struct strm_merger ss_merger = {
+  iter_ss, ss_clone, ss_merge,
+};
+
+#ifndef TOPK_MIN_COUNTERS
+#define TOPK_MIN_COUNTERS 1024
+#endif
+
+/* top_k(k[, counters]): emits [value, count] of most frequent k values */
+static int
+exec_top_k(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  strm_int k, capa = 0;
+
+  strm_get_args(strm, argc, args, "i|i", &k, &capa);
+  if (k <= 0) {
+    strm_raise(strm, "invalid number");
+    return STRM_NG;
+  }
+  if (argc == 1) {
+    capa = (k*10 < TOPK_MIN_COUNTERS) ? TOPK_MIN_COUNTERS : k*10;
+  }
+  else if (capa < k) {
+    strm_raise(strm, "too few counters");
+    return STRM_NG;
+  }
+  return ss_new(strm, k, 0, capa, ret);
+}
+
+/* heavy_hitters(phi): emits [value, count] of values appear more than
+   phi of the stream */
+static int
+exec_heavy_hitters(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  double phi;
+
+  strm_get_args(strm, argc, args, "f", &phi);
+  if (phi <= 0 || phi >= 1) {
+    strm_raise(strm, "threshold should be 0..1");
+    return STRM_NG;
+  }
+  return ss_new(strm, 0, phi, (strm_int)ceil(1/phi), ret);
+}
+
+/* distinct: drops values (or keys given by func) seen before.
+   exact mode keeps every distinct key in a hash set, so its memory
+   grows with the number of distinct keys (values are never freed, so
+   moving keys out of the set would not bound it).  bloom mode uses a
+   Bloom filter of constant size, and may drop unseen values at the
+   given false positive rate */
+struct set_entry {
+  uint64_t hash;                /* 0 for empty */
+  strm_value v;
+};
+
+struct value_set {
+  strm_int size;
+  strm_int len;
+  struct set_entry* e;
+};
+
+static int
+set_init(struct value_set* set, strm_int size)
+{
+  set->size = size;
+  set->len = 0;
+  set->e = calloc(size, sizeof(struct set_entry));
+  if (!set->e) return STRM_NG;
+  return STRM_OK;
+}
+
+static struct set_entry*
+set_find(struct value_set* set, uint64_t h, strm_value v)
+{
+  strm_int mask = set->size-1;
+  strm_int i = h & mask;
+
+  while (set->e[i].hash != 0) {
+    if (set->e[i].hash == h && strm_value_eq(set->e[i].v, v)) break;
+    i = (i+1) & mask;
+  }
+  return &set->e[i];
+}
+
+static int
+set_grow(struct value_set* set)
+{
+  struct value_set nset;
+  strm_int i;
+
+  if (set_init(&nset, set->size*2) == STRM_NG) return STRM_NG;
+  for (i=0; i<set->size; i++) {
+    if (set->e[i].hash != 0) {
+      *set_find(&nset, set->e[i].hash, set->e[i].v) = set->e[i];
+    }
+  }
+  nset.len = set->len;
+  free(set->e);
+  *set = nset;
+  return STRM_OK;
+}
+
+struct distinct_data {
+  strm_value func;
+  /* exact mode */
+  struct value_set set;
+  /* bloom mode */
+  uint64_t nbits;
+  strm_int k;
+  uint64_t bits[0];
+};
+
+static uint64_t
+distinct_hash(strm_value v)
+{
+  uint64_t h = strm_value_hash(v);
+
+  return h ? h : 1;
+}
+
+static int
+distinct_key(strm_stream* strm, struct distinct_data* d, strm_value data, strm_value* key)
+{
+  if (strm_nil_p(d->func)) {
+    *key = data;
+    return STRM_OK;
+  }
+  return strm_funcall(strm, d->func, 1, &data, key);
+}
+
+static int
+iter_distinct(strm_stream* strm, strm_value data)
+{
+  struct distinct_data* d = strm->data;
+  struct set_entry* e;
+  strm_value key;
+  uint64_t h;
+
+  if (distinct_key(strm, d, data, &key) == STRM_NG) return STRM_NG;
+  h = distinct_hash(key);
+  e = set_find(&d->set, h, key);
+  if (e->hash != 0) return STRM_OK;
+  e->hash = h;
+  e->v = key;
+  d->set.len++;
+  if (d->set.len*2 > d->set.size) {
+    if (set_grow(&d->set) == STRM_NG) return STRM_NG;
+  }
+  strm_emit(strm, data, NULL);
+  return STRM_OK;
+}
+
+static int
+finish_distinct(strm_stream* strm, strm_value data)
+{
+  struct distinct_data* d = strm->data;
+
+  free(d->set.e);
+  free(d);
+  return STRM_OK;
+}
+
+static int
+iter_distinct_bloom(strm_stream* strm, strm_value data)
+{
+  struct distinct_data* d = strm->data;
+  strm_value key;
+  uint64_t h1, h2;
+  strm_int i;
+  int seen = TRUE;
+
+  if (distinct_key(strm, d, data, &key) == STRM_NG) return STRM_NG;
+  h1 = strm_value_hash(key);
+  h2 = fmix64(h1 ^ 0x9e3779b97f4a7c15ULL) | 1;
+  for (i=0; i<d->k; i++) {
+    uint64_t b = (h1 + i*h2) % d->nbits;
+
+    if (!(d->bits[b/64] & ((uint64_t)1 << (b%64)))) {
+      seen = FALSE;
+      d->bits[b/64] |= ((uint64_t)1 << (b%64));
+    }
+  }
+  if (!seen) {
+    strm_emit(strm, data, NULL);
+  }
+  return STRM_OK;
+}
+
+/*
+  distinct([func])
+  distinct("bloom", n[, error][, func])
+*/
+static int
+exec_distinct(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  struct distinct_data* d;
+  strm_value func = strm_nil_value();
+
+  if (argc > 0 && strm_string_p(args[0])) {
+    strm_string mode;
+    double n, err = 0.01;
+    uint64_t nbits;
+
+    if (argc > 2 && !strm_number_p(args[argc-1])) {
+      func = args[argc-1];
+      argc--;
+    }
+    strm_get_args(strm, argc, args, "Sf|f", &mode, &n, &err);
+    if (!strm_str_eq(mode, strm_str_lit("bloom"))) {
+      strm_raise(strm, "unknown distinct mode");
+      return STRM_NG;
+    }
+    if (n < 1 || err <= 0 || err >= 1) {
+      strm_raise(strm, "invalid bloom filter parameter");
+      return STRM_NG;
+    }
+    nbits = (uint64_t)ceil(-n * log(err) / (M_LN2 * M_LN2));
+    nbits = (nbits + 63) / 64 * 64;
+    d = calloc(1, sizeof(struct distinct_data)+nbits/8);
+    if (!d) return STRM_NG;
+    d->func = func;
+    d->nbits = nbits;
+    d->k = (strm_int)round((double)nbits / n * M_LN2);
+    if (d->k < 1) d->k = 1;
+    *ret = strm_stream_value(strm_stream_new(strm_filter, iter_distinct_bloom,
+                                             NULL, (void*)d));
+    return STRM_OK;
+  }
+
+  strm_get_args(strm, argc, args, "|v", &func);
+  d = malloc(sizeof(struct distinct_data));
+  if (!d) return STRM_NG;
+  d->func = func;
+  if (set_init(&d->set, 1024) == STRM_NG) {
+    free(d);
+    return STRM_NG;
+  }
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_distinct,
+                                           finish_distinct, (void*)d));
+  return STRM_OK;
+}
+
+void
+strm_sketch_init(strm_state* state)
+{
+  strm_var_def(state, "count_distinct", strm_cfunc_value(exec_count_distinct));
+  strm_var_def(state, "top_k", strm_cfunc_value(exec_top_k));
+  strm_var_def(state, "heavy_hitters", strm_cfunc_value(exec_heavy_hitters));
+  strm_var_def(state, "distinct", strm_cfunc_value(exec_distinct));
+  strm_merger_def(&hll_merger);
+  strm_merger_def(&ss_merger);
+}
@@ -1,10 +1,13 @@
+#define _GNU_SOURCE
 #ifndef _WIN32
 # include <sys/fcntl.h>
 # include <sys/types.h>
 # include <sys/socket.h>
 # include <netinet/in.h>
+# include <netinet/tcp.h>
 # include <netdb.h>
 # include <stdio.h>
+# include <errno.h>
 # define closesocket(fd) close(fd)
 #else
 # include <ws2tcpip.h>
@@ -13,62 +16,230 @@
 #endif
 
 #include "strm.h"
+#include "atomic.h"
 
-struct socket_data {
+/* default length of the queue of pending connections */
+#ifndef STRM_TCP_BACKLOG
+#define STRM_TCP_BACKLOG SOMAXCONN
+#endif
+
+/* max number of listeners of a server with reuseport */
+#ifndef STRM_TCP_LISTENERS
+#define STRM_TCP_LISTENERS 64
+#endif
+
+/* max number of connections accepted per wakeup */
+#ifndef STRM_ACCEPT_BATCH
+#define STRM_ACCEPT_BATCH 256
+#endif
+
+struct server_data;
+
+struct listener {
   int sock;
+  struct server_data* sd;
 };
 
+/* a server has one or more listeners (more with SO_REUSEPORT); each
+   listener is a stream of its own, waited on by its own I/O thread
+   (round robin), and forwards accepted connections to the server
+   stream */
+struct server_data {
+  strm_stream* strm;
+  strm_int n;
+  strm_int refcnt;
+  int closed;
+  int nodelay;
+  int keepalive;
+  struct listener lsn[];
+};
+
+static void
+server_free(struct server_data* sd)
+{
+  if (strm_atomic_dec(sd->refcnt) == 1) {
+    free(sd);
+  }
+}
+
+static int
+server_emit(strm_stream* strm, strm_value data)
+{
+  strm_emit(strm, data, NULL);
+  return STRM_OK;
+}
+
+static void
+sock_setopt(int sock, int level, int opt, int val)
+{
+  setsockopt(sock, level, opt, (const void*)&val, sizeof(val));
+}
+
 static int
 accept_cb(strm_stream* task, strm_value data)
 {
-  struct socket_data *sd = task->data;
-  struct sockaddr_in writer_addr;
+  struct listener *l = task->data;
+  struct server_data *sd = l->sd;
+  struct sockaddr_storage writer_addr;
   socklen_t writer_len;
-  int sock;
+  int sock, i;
 
-  memset(&writer_addr, 0, sizeof(writer_addr));
-  writer_len = sizeof(writer_addr);
-  sock = accept(sd->sock, (struct sockaddr *)&writer_addr, &writer_len);
-  if (sock < 0) {
-    closesocket(sock);
-    strm_raise(task, "socket error: listen");
-    return STRM_NG;
+  for (i=0; i<STRM_ACCEPT_BATCH; i++) {
+    if (sd->closed) {
+      strm_stream_close(task);
+      return STRM_OK;
+    }
+    writer_len = sizeof(writer_addr);
+#if !defined(_WIN32) && defined(SOCK_CLOEXEC)
+    sock = accept4(l->sock, (struct sockaddr *)&writer_addr, &writer_len, SOCK_CLOEXEC);
+#else
+    sock = accept(l->sock, (struct sockaddr *)&writer_addr, &writer_len);
+#endif
+    if (sock < 0) {
+      switch (errno) {
+      case EINTR:
+      case ECONNABORTED:
+        continue;
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+        break;
+      default:
+        if (sd->closed) {
+          strm_stream_close(task);
+          return STRM_OK;
+        }
+        strm_raise(task, "socket error: accept");
+        return STRM_NG;
+      }
+      break;
+    }
+    if (sd->nodelay)
+      sock_setopt(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (sd->keepalive)
+      sock_setopt(sock, SOL_SOCKET, SO_KEEPALIVE, 1);
+    strm_task_push(sd->strm, server_emit,
+                   strm_io_new(sock, STRM_IO_READ|STRM_IO_WRITE|STRM_IO_FLUSH));
+#ifdef _WIN32
+    /* the listening socket is blocking */
+    break;
+#endif
   }
+  strm_io_kick(task, l->sock, accept_cb);
+  return STRM_OK;
+}
+
+static int
+listener_close(strm_stream* task, strm_value d)
+{
+  struct listener *l = task->data;
 
-  strm_io_emit(task, strm_io_new(sock, STRM_IO_READ|STRM_IO_WRITE|STRM_IO_FLUSH),
-               sd->sock, accept_cb);
+  closesocket(l->sock);
+  server_free(l->sd);
   return STRM_OK;
 }
 
 static int
 server_accept(strm_stream* task, strm_value data)
 {
-  struct socket_data *sd = task->data;
+  struct server_data *sd = task->data;
+  strm_int i;
 
-  strm_io_start_read(task, sd->sock, accept_cb);
+  for (i=0; i<sd->n; i++) {
+    strm_stream* t = strm_stream_new(strm_producer, NULL, listener_close, &sd->lsn[i]);
+    strm_io_set_thread(t, i);
+    strm_io_start_read(t, sd->lsn[i].sock, accept_cb);
+  }
   return STRM_OK;
 }
 
 static int
 server_close(strm_stream* task, strm_value d)
 {
-  struct socket_data *sd = task->data;
+  struct server_data *sd = task->data;
+  strm_int i;
 
-  closesocket(sd->sock);
-  free(sd);
+  /* wake up listeners to let them close */
+  sd->closed = TRUE;
+  for (i=0; i<sd->n; i++) {
+    shutdown(sd->lsn[i].sock, SHUT_RDWR);
+  }
+  server_free(sd);
   return STRM_OK;
 }
 
+/* look up an option from a struct, e.g. [backlog:1024] */
+static int
+server_opt(strm_array opts, const char* key, strm_value* val)
+{
+  struct strm_array* a;
+  strm_value* headers;
+  strm_int i;
+
+  if (strm_nil_p(opts)) return FALSE;
+  a = strm_ary_struct(opts);
+  if (!a->headers) return FALSE;
+  headers = strm_ary_ptr(a->headers);
+  for (i=0; i<a->len; i++) {
+    strm_string h = strm_value_str(headers[i]);
+
+    if (strm_str_len(h) == strlen(key) &&
+        memcmp(strm_str_ptr(h), key, strm_str_len(h)) == 0) {
+      *val = a->ptr[i];
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static int
+server_listen(struct addrinfo *result, int backlog, int reuseport)
+{
+  struct addrinfo *rp;
+  int sock;
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sock == -1) continue;
+
+    sock_setopt(sock, SOL_SOCKET, SO_REUSEADDR, 1);
+#ifdef SO_REUSEPORT
+    if (reuseport)
+      sock_setopt(sock, SOL_SOCKET, SO_REUSEPORT, 1);
+#endif
+    if (bind(sock, rp->ai_addr, rp->ai_addrlen) == 0)
+      break;                    /* Success */
+    closesocket(sock);
+  }
+  if (rp == NULL) return -1;
+  if (listen(sock, backlog) < 0) {
+    closesocket(sock);
+    return -2;
+  }
+#ifndef _WIN32
+  /* accept_cb() drains pending connections until EAGAIN */
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+#endif
+  return sock;
+}
+
+/* tcp_server(port[, [backlog:n, reuseport:b_or_n, nodelay:b, keepalive:b]]) */
 static int
 tcp_server(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 {
   struct addrinfo hints;
-  struct addrinfo *result, *rp;
+  struct addrinfo *result;
   int sock, s;
-  strm_value srv;
+  strm_value srv, v;
+  strm_array opts = strm_nil_value();
   const char *service;
   char buf[12];
-  struct socket_data *sd;
+  struct server_data *sd;
+  strm_int i, n = 1;
+  int backlog = STRM_TCP_BACKLOG;
+  int nodelay = FALSE, keepalive = FALSE;
   strm_stream *t;
 
 #ifdef _WIN32
@@ -78,7 +249,7 @@ tcp_server(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   setsockopt(INVALID_SOCKET, SOL_SOCKET, SO_OPENTYPE, (char *)&sockopt, sizeof(sockopt));
 #endif
 
-  strm_get_args(strm, argc, args, "v", &srv);
+  strm_get_args(strm, argc, args, "v|A", &srv, &opts);
   if (strm_number_p(srv)) {
     sprintf(buf, "%d", (int)strm_value_int(srv));
     service = buf;
@@ -86,7 +257,37 @@ tcp_server(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   else {
     strm_string str = strm_value_str(srv);
     service = strm_str_cstr(str, buf);
+    if (!service) {
+      strm_raise(strm, "out of memory");
+      return STRM_NG;
+    }
+  }
+  if (server_opt(opts, "backlog", &v)) {
+    if (!strm_number_p(v) || strm_value_int(v) <= 0) {
+      strm_raise(strm, "backlog should be a positive number");
+      return STRM_NG;
+    }
+    backlog = strm_value_int(v);
   }
+  if (server_opt(opts, "reuseport", &v)) {
+    /* true: one listener per I/O thread */
+    if (strm_number_p(v))
+      n = strm_value_int(v);
+    else if (strm_value_bool(v))
+      n = strm_io_thread_count();
+    if (n <= 0) n = 1;
+    if (n > STRM_TCP_LISTENERS) {
+      strm_raise(strm, "too many listeners for reuseport");
+      return STRM_NG;
+    }
+#ifndef SO_REUSEPORT
+    n = 1;
+#endif
+  }
+  if (server_opt(opts, "nodelay", &v))
+    nodelay = strm_value_bool(v);
+  if (server_opt(opts, "keepalive", &v))
+    keepalive = strm_value_bool(v);
 
   memset(&hints, 0, sizeof(struct addrinfo));
 #ifdef _WIN32
@@ -108,30 +309,38 @@ tcp_server(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
     break;
   }
 
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if (sock == -1) continue;
-
-    if (bind(sock, rp->ai_addr, rp->ai_addrlen) == 0)
-      break;                    /* Success */
-    closesocket(sock);
-  }
-
-  freeaddrinfo(result);
-  if (rp == NULL) {
-    strm_raise(strm, "socket error: bind");
+  sd = malloc(sizeof(struct server_data)+sizeof(struct listener)*n);
+  if (!sd) {
+    freeaddrinfo(result);
+    strm_raise(strm, "out of memory");
     return STRM_NG;
   }
-
-  if (listen(sock, 5) < 0) {
-    closesocket(sock);
-    strm_raise(strm, "socket error: listen");
-    return STRM_NG;
+  for (i=0; i<n; i++) {
+    sock = server_listen(result, backlog, n > 1);
+    if (sock < 0) {
+      while (i > 0) {
+        closesocket(sd->lsn[--i].sock);
+      }
+      free(sd);
+      freeaddrinfo(result);
+      if (sock == -1)
+        strm_raise(strm, "socket error: bind");
+      else
+        strm_raise(strm, "socket error: listen");
+      return STRM_NG;
+    }
+    sd->lsn[i].sock = sock;
+    sd->lsn[i].sd = sd;
   }
+  freeaddrinfo(result);
 
-  sd = malloc(sizeof(struct socket_data));
-  sd->sock = sock;
+  sd->n = n;
+  sd->refcnt = n+1;
+  sd->closed = FALSE;
+  sd->nodelay = nodelay;
+  sd->keepalive = keepalive;
   t = strm_stream_new(strm_producer, server_accept, server_close, (void*)sd);
+  sd->strm = t;
   *ret = strm_stream_value(t);
   return STRM_OK;
 }
@@ -142,7 +351,7 @@ tcp_socket(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   struct addrinfo hints;
   struct addrinfo *result, *rp;
   int sock, s;
-  const char *service;
+  const char *service, *node;
   char sbuf[12], hbuf[7];
   strm_string host;
   strm_value srv;
@@ -160,6 +369,10 @@ tcp_socket(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   else {
     strm_string str = strm_value_str(srv);
     service = strm_str_cstr(str, sbuf);
+    if (!service) {
+      strm_raise(strm, "out of memory");
+      return STRM_NG;
+    }
   }
 
   memset(&hints, 0, sizeof(struct addrinfo));
@@ -170,7 +383,12 @@ tcp_socket(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 #endif
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = 0;          /* Any protocol */
-  s = getaddrinfo(strm_str_cstr(host, hbuf), service, &hints, &result);
+  node = strm_str_cstr(host, hbuf);
+  if (!node) {
+    strm_raise(strm, "out of memory");
+    return STRM_NG;
+  }
+  s = getaddrinfo(node, service, &hints, &result);
 
   if (s != 0) {
     strm_raise(strm, gai_strerror(s));
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include "strm.h"
 #include <stdlib.h>
+#include <math.h>
 
 #ifdef NO_QSORT_R
 /* qsort_r() implementation taken from github.com/stevengj/nlopt */
@@ -183,17 +184,146 @@ sort_cmpf cmp_args(const void* a_p, const void* b_p, void* arg)
   return 0;
 }
 
+/* type specialized sort kernels; values are sorted as (key, value) pairs */
+struct sort_pair {
+  uint64_t key;
+  strm_value v;
+};
+
+/* map double to unsigned integer preserving order */
+static inline uint64_t
+num_key(double d)
+{
+  union {
+    double f;
+    uint64_t i;
+  } u;
+
+  u.f = d;
+  if (u.i & ((uint64_t)1<<63)) return ~u.i;
+  return u.i | ((uint64_t)1<<63);
+}
+
+/* first 8 bytes of the string in big endian */
+static inline uint64_t
+str_key(strm_value v)
+{
+  strm_string str = strm_value_str(v);
+  const char* s = strm_str_ptr(str);
+  strm_int len = strm_str_len(str);
+  uint64_t k = 0;
+  strm_int i;
+
+  for (i=0; i<8; i++) {
+    k <<= 8;
+    if (i < len) k |= (unsigned char)s[i];
+  }
+  return k;
+}
+
+/* stable LSD radix sort on keys; tmp should have len elements */
+static void
+radix_sort(struct sort_pair* p, struct sort_pair* tmp, strm_int len)
+{
+  static const int nbytes = sizeof(uint64_t);
+  strm_int count[sizeof(uint64_t)][256];
+  struct sort_pair* src = p;
+  struct sort_pair* dst = tmp;
+  strm_int i;
+  int b;
+
+  memset(count, 0, sizeof(count));
+  /* histograms for all bytes in one pass */
+  for (i=0; i<len; i++) {
+    uint64_t k = p[i].key;
+    for (b=0; b<nbytes; b++) {
+      count[b][(k>>(b*8))&0xff]++;
+    }
+  }
+  for (b=0; b<nbytes; b++) {
+    strm_int* c = count[b];
+    strm_int j, sum;
+
+    /* skip bytes that are same for all keys */
+    if (c[(src[0].key>>(b*8))&0xff] == len) continue;
+    for (j=0,sum=0; j<256; j++) {
+      strm_int n = c[j];
+      c[j] = sum;
+      sum += n;
+    }
+    for (i=0; i<len; i++) {
+      dst[c[(src[i].key>>(b*8))&0xff]++] = src[i];
+    }
+    tmp = src; src = dst; dst = tmp;
+  }
+  if (src != p) {
+    memcpy(p, src, sizeof(struct sort_pair)*len);
+  }
+}
+
+static int
+str_pair_cmp(const void* a_p, const void* b_p)
+{
+  const struct sort_pair* a = a_p;
+  const struct sort_pair* b = b_p;
+
+  if (a->key > b->key) return 1;
+  if (a->key < b->key) return -1;
+  return str_cmp(a->v, b->v);
+}
+
+#ifndef SORT_RADIX_MIN
+#define SORT_RADIX_MIN 64
+#endif
+
+/* sort values without strm_cmp() if all values are numbers or strings;
+   returns FALSE if values are mixed */
+static int
+typed_sort(strm_value* p, strm_int len)
+{
+  struct sort_pair* buf;
+  strm_int i;
+  int num = TRUE, str = TRUE;
+
+  for (i=0; i<len; i++) {
+    if (num && !strm_number_p(p[i])) num = FALSE;
+    if (str && !strm_string_p(p[i])) str = FALSE;
+    if (!num && !str) return FALSE;
+  }
+  if (num && len < SORT_RADIX_MIN) return FALSE;
+  buf = malloc(sizeof(struct sort_pair)*len*(num ? 2 : 1));
+  if (!buf) return FALSE;
+  for (i=0; i<len; i++) {
+    buf[i].key = num ? num_key(strm_value_float(p[i])) : str_key(p[i]);
+    buf[i].v = p[i];
+  }
+  if (num) {
+    radix_sort(buf, buf+len, len);
+  }
+  else {
+    qsort(buf, len, sizeof(struct sort_pair), str_pair_cmp);
+  }
+  for (i=0; i<len; i++) {
+    p[i] = buf[i].v;
+  }
+  free(buf);
+  return TRUE;
+}
+
 static void
 mem_sort(strm_value* p, strm_int len, struct sort_arg *arg)
 {
   if (arg) {                    /* sort(ary, func) */
     qsort_arg(p, len, sizeof(strm_value), sort_cmpf, arg);
   }
-  else {                        /* sort(ary) */
+  else if (!typed_sort(p, len)) { /* sort(ary) */
     qsort(p, len, sizeof(strm_value), sort_cmp);
   }
 }
 
+/* sort and sort_by keep all records in memory until the end of the
+   stream; values are never freed, so spilling records to temporary
+   files would not bound the memory they hold */
 struct sort_data {
   strm_int len;
   strm_int capa;
@@ -203,14 +333,32 @@ struct sort_data {
 
 #define SORT_FIRST_CAPA 1024
 
+static void
+sort_buf(strm_stream* strm, struct sort_data* d)
+{
+  if (strm_nil_p(d->func)) {
+    mem_sort(d->buf, d->len, NULL);
+  }
+  else {
+    struct sort_arg arg;
+
+    arg.strm = strm;
+    arg.func = d->func;
+    mem_sort(d->buf, d->len, &arg);
+  }
+}
+
 static int
 iter_sort(strm_stream* strm, strm_value data)
 {
   struct sort_data* d = strm->data;
 
   if (d->len >= d->capa) {
+    strm_value* buf = realloc(d->buf, sizeof(strm_value)*d->capa*2);
+
+    if (!buf) return STRM_NG;
     d->capa *= 2;
-    d->buf = realloc(d->buf, sizeof(strm_value)*d->capa);
+    d->buf = buf;
   }
   d->buf[d->len++] = data;
   return STRM_OK;
@@ -222,17 +370,7 @@ finish_sort(strm_stream* strm, strm_value data)
   struct sort_data* d = strm->data;
   strm_int i, len;
 
-  if (strm_nil_p(d->func)) {
-    mem_sort(d->buf, d->len, NULL);
-  }
-  else {
-    struct sort_arg arg;
-
-    arg.strm = strm;
-    arg.func = d->func;
-    mem_sort(d->buf, d->len, &arg);
-  }
-
+  sort_buf(strm, d);
   for (i=0,len=d->len; i<len; i++) {
     strm_emit(strm, d->buf[i], NULL);
   }
@@ -253,7 +391,7 @@ exec_sort(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   d->func = func;
   d->len = 0;
   d->capa = SORT_FIRST_CAPA;
-  d->buf = malloc(sizeof(strm_value)*SORT_FIRST_CAPA);
+  d->buf = malloc(sizeof(strm_value)*d->capa);
   if (!d->buf) {
     free(d);
     return STRM_NG;
@@ -316,6 +454,16 @@ sortby_cmp(const void* a_p, const void* b_p)
     if (strm_number_p(bv->v)) {
       return 1;
     }
+    /* num < str < other */
+    if (strm_string_p(av->v)) {
+      if (strm_string_p(bv->v)) {
+        return str_cmp(av->v, bv->v);
+      }
+      return -1;
+    }
+    if (strm_string_p(bv->v)) {
+      return 1;
+    }
     return 0;
   }
   if (strm_number_p(bv->v)) {
@@ -331,14 +479,89 @@ sortby_cmp(const void* a_p, const void* b_p)
   return 0;
 }
 
+/* stable sort; keys are compared without calling the key function */
+static int
+sortby_ptr_cmp(const void* a_p, const void* b_p)
+{
+  struct sortby_value* a = *(struct sortby_value**)a_p;
+  struct sortby_value* b = *(struct sortby_value**)b_p;
+  int c = sortby_cmp(a, b);
+
+  if (c != 0) return c;
+  if (a < b) return -1;
+  if (a > b) return 1;
+  return 0;
+}
+
+static void
+sortby_sort(struct sortby_value* buf, strm_int len)
+{
+  struct sortby_value* tmp;
+  strm_int i;
+  int num = TRUE;
+
+  if (len < 2) return;
+  tmp = malloc(sizeof(struct sortby_value)*len);
+  if (!tmp) {
+    qsort(buf, len, sizeof(struct sortby_value), sortby_cmp);
+    return;
+  }
+  memcpy(tmp, buf, sizeof(struct sortby_value)*len);
+  for (i=0; i<len; i++) {
+    if (!strm_number_p(buf[i].v)) {
+      num = FALSE;
+      break;
+    }
+  }
+  if (num && len >= SORT_RADIX_MIN) {
+    /* sort packed (key, index) pairs */
+    struct sort_pair* pairs = malloc(sizeof(struct sort_pair)*len*2);
+
+    if (pairs) {
+      for (i=0; i<len; i++) {
+        pairs[i].key = num_key(strm_value_float(buf[i].v));
+        pairs[i].v = i;
+      }
+      radix_sort(pairs, pairs+len, len);
+      for (i=0; i<len; i++) {
+        buf[i] = tmp[pairs[i].v];
+      }
+      free(pairs);
+      free(tmp);
+      return;
+    }
+  }
+  else {
+    struct sortby_value** ptrs = malloc(sizeof(struct sortby_value*)*len);
+
+    if (ptrs) {
+      for (i=0; i<len; i++) {
+        ptrs[i] = &tmp[i];
+      }
+      qsort(ptrs, len, sizeof(struct sortby_value*), sortby_ptr_cmp);
+      for (i=0; i<len; i++) {
+        buf[i] = *ptrs[i];
+      }
+      free(ptrs);
+      free(tmp);
+      return;
+    }
+  }
+  free(tmp);
+  qsort(buf, len, sizeof(struct sortby_value), sortby_cmp);
+}
+
 static int
 iter_sortby(strm_stream* strm, strm_value data)
 {
   struct sortby_data* d = strm->data;
 
   if (d->len >= d->capa) {
+    struct sortby_value* buf = realloc(d->buf, sizeof(struct sortby_value)*d->capa*2);
+
+    if (!buf) return STRM_NG;
     d->capa *= 2;
-    d->buf = realloc(d->buf, sizeof(struct sortby_value)*d->capa);
+    d->buf = buf;
   }
   d->buf[d->len].o = data;
   if (strm_funcall(d->strm, d->func, 1, &data, &d->buf[d->len].v) == STRM_NG) {
@@ -354,7 +577,7 @@ finish_sortby(strm_stream* strm, strm_value data)
   struct sortby_data* d = strm->data;
   strm_int i, len;
 
-  qsort(d->buf, d->len, sizeof(struct sortby_value), sortby_cmp);
+  sortby_sort(d->buf, d->len);
   for (i=0,len=d->len; i<len; i++) {
     strm_emit(strm, d->buf[i].o, NULL);
   }
@@ -363,13 +586,131 @@ finish_sortby(strm_stream* strm, strm_value data)
   return STRM_OK;
 }
 
+/* top-k: sort_by(func, limit) keeps only limit values in a max-heap */
+struct sortby_top {
+  struct sortby_value sv;
+  uint64_t seq;
+};
+
+struct sortby_top_data {
+  strm_int k;
+  strm_int n;
+  uint64_t seq;
+  strm_value func;
+  struct sortby_top* heap;
+};
+
+static int
+sortby_top_cmp(const void* a_p, const void* b_p)
+{
+  const struct sortby_top* a = a_p;
+  const struct sortby_top* b = b_p;
+  int c = sortby_cmp(&a->sv, &b->sv);
+
+  if (c != 0) return c;
+  if (a->seq < b->seq) return -1;
+  if (a->seq > b->seq) return 1;
+  return 0;
+}
+
+#define TOP_SWAP(a,b) { struct sortby_top t=(a);(a)=(b);(b)=t; }
+
+static int
+iter_sortby_top(strm_stream* strm, strm_value data)
+{
+  struct sortby_top_data* d = strm->data;
+  struct sortby_top* h = d->heap;
+  struct sortby_top e;
+  strm_int i;
+
+  e.sv.o = data;
+  if (strm_funcall(strm, d->func, 1, &data, &e.sv.v) == STRM_NG) {
+    return STRM_NG;
+  }
+  e.seq = d->seq++;
+  if (d->n < d->k) {            /* sift up */
+    i = d->n++;
+    h[i] = e;
+    while (i > 0 && sortby_top_cmp(&h[(i-1)/2], &h[i]) < 0) {
+      TOP_SWAP(h[(i-1)/2], h[i]);
+      i = (i-1)/2;
+    }
+  }
+  else if (sortby_top_cmp(&e, &h[0]) < 0) { /* replace the largest */
+    h[0] = e;
+    i = 0;
+    for (;;) {
+      strm_int l = i*2+1;
+      strm_int m = i;
+
+      if (l < d->n && sortby_top_cmp(&h[l], &h[m]) > 0) m = l;
+      if (l+1 < d->n && sortby_top_cmp(&h[l+1], &h[m]) > 0) m = l+1;
+      if (m == i) break;
+      TOP_SWAP(h[i], h[m]);
+      i = m;
+    }
+  }
+  return STRM_OK;
+}
+
+#undef TOP_SWAP
+
+static int
+finish_sortby_top(strm_stream* strm, strm_value data)
+{
+  struct sortby_top_data* d = strm->data;
+  strm_int i;
+
+  qsort(d->heap, d->n, sizeof(struct sortby_top), sortby_top_cmp);
+  for (i=0; i<d->n; i++) {
+    strm_emit(strm, d->heap[i].sv.o, NULL);
+  }
+  free(d->heap);
+  free(d);
+  return STRM_OK;
+}
+
+static int
+exec_sortby_top(strm_stream* strm, strm_value func, strm_int limit, strm_value* ret)
+{
+  struct sortby_top_data* d;
+
+  if (limit <= 0) {
+    strm_raise(strm, "invalid limit");
+    return STRM_NG;
+  }
+  d = malloc(sizeof(struct sortby_top_data));
+  if (!d) return STRM_NG;
+  d->k = limit;
+  d->n = 0;
+  d->seq = 0;
+  d->func = func;
+  d->heap = malloc(sizeof(struct sortby_top)*limit);
+  if (!d->heap) {
+    free(d);
+    return STRM_NG;
+  }
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_sortby_top,
+                                           finish_sortby_top, (void*)d));
+  return STRM_OK;
+}
+
 static int
 exec_sortby(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 {
   struct sortby_data* d;
   strm_value func;
+  strm_int limit;
 
-  strm_get_args(strm, argc, args, "v", &func);
+  if (argc == 2 && strm_number_p(args[0])) { /* sort_by(limit){...} */
+    strm_get_args(strm, argc, args, "iv", &limit, &func);
+  }
+  else {
+    strm_get_args(strm, argc, args, "v|i", &func, &limit);
+  }
+  if (argc == 2) {
+    return exec_sortby_top(strm, func, limit, ret);
+  }
 
   d = malloc(sizeof(struct sortby_data));
   if (!d) return STRM_NG;
@@ -377,7 +718,7 @@ exec_sortby(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   d->func = func;
   d->len = 0;
   d->capa = SORT_FIRST_CAPA;
-  d->buf = malloc(sizeof(struct sortby_value)*SORT_FIRST_CAPA);
+  d->buf = malloc(sizeof(struct sortby_value)*d->capa);
   if (!d->buf) {
     free(d);
     return STRM_NG;
@@ -395,9 +736,18 @@ ary_sortby(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   strm_int len;
   strm_value func;
   strm_array ary;
-  strm_int i;
+  strm_int i, limit;
 
-  strm_get_args(strm, argc, args, "av", &p, &len, &func);
+  if (argc == 3 && strm_number_p(args[1])) { /* sort_by(limit){...} */
+    strm_get_args(strm, argc, args, "aiv", &p, &len, &limit, &func);
+  }
+  else {
+    strm_get_args(strm, argc, args, "av|i", &p, &len, &func, &limit);
+  }
+  if (argc == 3 && limit <= 0) {
+    strm_raise(strm, "invalid limit");
+    return STRM_NG;
+  }
 
   buf = malloc(sizeof(struct sortby_value)*len);
   if (!buf) return STRM_NG;
@@ -408,7 +758,10 @@ ary_sortby(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
       return STRM_NG;;
     }
   }
-  qsort(buf, len, sizeof(struct sortby_value), sortby_cmp);
+  sortby_sort(buf, len);
+  if (argc == 3 && limit < len) {
+    len = limit;
+  }
   ary = strm_ary_new(NULL, len);
   p = strm_ary_ptr(ary);
   for (i=0; i<len; i++) {
@@ -588,6 +941,315 @@ ary_median(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return STRM_OK;
 }
 
+/* approximate quantiles by merging t-digest (Ted Dunning); the memory
+   use is bounded by compression.  centroids are weighted points, so
+   partial digests can be merged by adding their centroids */
+#ifndef TDIGEST_COMPRESSION
+#define TDIGEST_COMPRESSION 100
+#endif
+
+struct centroid {
+  double mean;
+  double weight;
+};
+
+struct tdigest {
+  double compression;
+  double total;                 /* weight of merged centroids */
+  double min, max;
+  strm_int ncent;
+  strm_int nbuf;
+  strm_int capa;                /* size of centroid buffer */
+  strm_int bcapa;               /* size of unmerged buffer */
+  struct centroid* cent;        /* merged centroids followed by unmerged values */
+};
+
+static struct tdigest*
+tdigest_new(double compression)
+{
+  struct tdigest* td = malloc(sizeof(struct tdigest));
+
+  if (!td) return NULL;
+  td->compression = compression;
+  td->total = 0;
+  td->min = INFINITY;
+  td->max = -INFINITY;
+  td->ncent = td->nbuf = 0;
+  td->capa = (strm_int)ceil(compression)*2 + 10;
+  td->bcapa = (strm_int)ceil(compression)*5;
+  td->cent = malloc(sizeof(struct centroid)*(td->capa+td->bcapa));
+  if (!td->cent) {
+    free(td);
+    return NULL;
+  }
+  return td;
+}
+
+static void
+tdigest_free(struct tdigest* td)
+{
+  free(td->cent);
+  free(td);
+}
+
+static int
+centroid_cmp(const void* a_p, const void* b_p)
+{
+  const struct centroid* a = a_p;
+  const struct centroid* b = b_p;
+
+  if (a->mean > b->mean) return 1;
+  if (a->mean < b->mean) return -1;
+  return 0;
+}
+
+/* scale function k1: k(q) = d/2pi * asin(2q-1) */
+static double
+tdigest_qlimit(struct tdigest* td, double q)
+{
+  double k = td->compression / (2*M_PI) * asin(2*q-1) + 1;
+
+  if (k >= td->compression/4) return 1.0;
+  return (sin(k * 2*M_PI / td->compression) + 1) / 2;
+}
+
+static void
+tdigest_compress(struct tdigest* td)
+{
+  struct centroid* c = td->cent;
+  strm_int i, n = td->ncent + td->nbuf;
+  strm_int m = 0;
+  double total = 0, wso = 0, wlimit;
+
+  if (td->nbuf == 0) return;
+  for (i=0; i<n; i++) {
+    total += c[i].weight;
+  }
+  qsort(c, n, sizeof(struct centroid), centroid_cmp);
+  wlimit = total * tdigest_qlimit(td, 0);
+  for (i=1; i<n; i++) {
+    double w = c[m].weight + c[i].weight;
+
+    if (wso + w <= wlimit) {
+      c[m].mean += (c[i].mean - c[m].mean) * c[i].weight / w;
+      c[m].weight = w;
+    }
+    else {
+      wso += c[m].weight;
+      wlimit = total * tdigest_qlimit(td, wso/total);
+      c[++m] = c[i];
+    }
+  }
+  td->ncent = m+1;
+  td->nbuf = 0;
+  td->total = total;
+}
+
+static void
+tdigest_add(struct tdigest* td, double x, double w)
+{
+  struct centroid* c;
+
+  if (td->nbuf == td->bcapa || td->ncent + td->nbuf == td->capa + td->bcapa) {
+    tdigest_compress(td);
+  }
+  c = &td->cent[td->ncent + td->nbuf++];
+  c->mean = x;
+  c->weight = w;
+  if (x < td->min) td->min = x;
+  if (x > td->max) td->max = x;
+}
+
+/* add centroids of src to td */
+static void
+tdigest_merge(struct tdigest* td, struct tdigest* src)
+{
+  strm_int i;
+
+  tdigest_compress(src);
+  for (i=0; i<src->ncent; i++) {
+    tdigest_add(td, src->cent[i].mean, src->cent[i].weight);
+  }
+  if (src->min < td->min) td->min = src->min;
+  if (src->max > td->max) td->max = src->max;
+}
+
+static double
+tdigest_quantile(struct tdigest* td, double q)
+{
+  struct centroid* c = td->cent;
+  strm_int i, n;
+  double t, cum = 0;
+
+  tdigest_compress(td);
+  n = td->ncent;
+  if (n == 0) return NAN;
+  if (n == 1 || q <= 0) return (n == 1) ? c[0].mean : td->min;
+  if (q >= 1) return td->max;
+
+  t = q * td->total;
+  for (i=0; i<n; i++) {
+    double mid = cum + c[i].weight/2;
+
+    if (t < mid) {
+      double pmid;
+
+      if (i == 0) {
+        return td->min + (c[0].mean - td->min) * t / mid;
+      }
+      pmid = cum - c[i-1].weight/2;
+      return c[i-1].mean + (c[i].mean - c[i-1].mean) * (t - pmid) / (mid - pmid);
+    }
+    cum += c[i].weight;
+  }
+  t -= td->total - c[n-1].weight/2;
+  return c[n-1].mean + (td->max - c[n-1].mean) * t / (c[n-1].weight/2);
+}
+
+struct quantile_data {
+  struct tdigest* td;
+  strm_int n;
+  double q[0];
+};
+
+static int
+iter_quantile(strm_stream* strm, strm_value data)
+{
+  struct quantile_data* d = strm->data;
+
+  if (!strm_number_p(data)) {
+    strm_raise(strm, "number required");
+    return STRM_NG;
+  }
+  tdigest_add(d->td, strm_value_float(data), 1);
+  return STRM_OK;
+}
+
+static int
+finish_quantile(strm_stream* strm, strm_value data)
+{
+  struct quantile_data* d = strm->data;
+  strm_int i;
+
+  if (d->n == 1) {
+    strm_emit(strm, strm_float_value(tdigest_quantile(d->td, d->q[0])), NULL);
+  }
+  else {
+    strm_array a = strm_ary_new(NULL, d->n);
+    strm_value* p = strm_ary_ptr(a);
+
+    for (i=0; i<d->n; i++) {
+      p[i] = strm_float_value(tdigest_quantile(d->td, d->q[i]));
+    }
+    strm_emit(strm, strm_ary_value(a), NULL);
+  }
+  tdigest_free(d->td);
+  free(d);
+  return STRM_OK;
+}
+
+static void*
+quantile_clone(void* data)
+{
+  struct quantile_data* d = data;
+  struct quantile_data* d2 = malloc(sizeof(struct quantile_data)+sizeof(double)*d->n);
+
+  if (!d2) return NULL;
+  memcpy(d2, d, sizeof(struct quantile_data)+sizeof(double)*d->n);
+  d2->td = tdigest_new(d->td->compression);
+  if (!d2->td) {
+    free(d2);
+    return NULL;
+  }
+  return d2;
+}
+
+static void
+quantile_merge(void* data, void* part)
+{
+  struct quantile_data* d = data;
+  struct quantile_data* p = part;
+
+  tdigest_merge(d->td, p->td);
+  tdigest_free(p->td);
+  free(p);
+}
+
+static const struct strm_merger quantile_merger = {
+  iter_quantile, quantile_clone, quantile_merge,
+};
+
+/* quantile(q, ...) or quantile([q, ...], compression) */
+static int
+quantile_new(strm_stream* strm, int argc, strm_value* args, strm_value* ret, double scale)
+{
+  struct quantile_data* d;
+  double compression = TDIGEST_COMPRESSION;
+  strm_int i;
+
+  if (argc > 0 && strm_array_p(args[0])) {
+    strm_value* v;
+    strm_int len;
+
+    strm_get_args(strm, argc, args, "a|f", &v, &len, &compression);
+    args = v;
+    argc = len;
+  }
+  if (argc == 0) {
+    strm_raise(strm, "no quantile given");
+    return STRM_NG;
+  }
+  if (compression < 10) {
+    strm_raise(strm, "compression too small");
+    return STRM_NG;
+  }
+  d = malloc(sizeof(struct quantile_data)+sizeof(double)*argc);
+  if (!d) return STRM_NG;
+  d->n = argc;
+  for (i=0; i<argc; i++) {
+    if (!strm_number_p(args[i])) {
+      strm_raise(strm, "number required");
+      free(d);
+      return STRM_NG;
+    }
+    d->q[i] = strm_value_float(args[i]) / scale;
+    if (d->q[i] < 0 || d->q[i] > 1) {
+      strm_raise(strm, "quantile out of range");
+      free(d);
+      return STRM_NG;
+    }
+  }
+  d->td = tdigest_new(compression);
+  if (!d->td) {
+    free(d);
+    return STRM_NG;
+  }
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_quantile,
+                                           finish_quantile, (void*)d));
+  return STRM_OK;
+}
+
+static int
+exec_quantile(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return quantile_new(strm, argc, args, ret, 1);
+}
+
+static int
+exec_percentiles(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  if (argc == 0) {
+    strm_value p[4];
+
+    p[0] = strm_int_value(50);
+    p[1] = strm_int_value(90);
+    p[2] = strm_int_value(95);
+    p[3] = strm_int_value(99);
+    return quantile_new(strm, 4, p, ret, 100);
+  }
+  return quantile_new(strm, argc, args, ret, 100);
+}
+
 static int
 exec_cmp(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 {
@@ -658,6 +1320,9 @@ strm_sort_init(strm_state* state)
   strm_var_def(state, "sort", strm_cfunc_value(exec_sort));
   strm_var_def(state, "sort_by", strm_cfunc_value(exec_sortby));
   strm_var_def(state, "median", strm_cfunc_value(exec_median));
+  strm_var_def(state, "quantile", strm_cfunc_value(exec_quantile));
+  strm_var_def(state, "percentiles", strm_cfunc_value(exec_percentiles));
+  strm_merger_def(&quantile_merger);
 
   strm_var_def(strm_ns_string, "<", strm_cfunc_value(str_lt));
   strm_var_def(strm_ns_string, "<=", strm_cfunc_value(str_le));
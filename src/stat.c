@@ -1,5 +1,8 @@
 #include "strm.h"
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 struct sum_data {
   double sum;
@@ -43,6 +46,206 @@ convert_number(strm_stream* strm, strm_value data, strm_value func)
   return val;
 }
 
+/* numeric kernels on unboxed doubles; accumulators are split into
+   independent lanes, two SSE2 registers of two lanes each (plain
+   loops are used where SSE2 is not available).  both compute the same
+   operations in the same order, so results do not depend on it */
+#define KERNEL_LANES 4
+
+#ifdef __SSE2__
+/* compensated step on two lanes; the rounding error of the addition is
+   computed without branches (Knuth's TwoSum), which is exactly what
+   the Neumaier step adds */
+#define TWOSUM_PD(s, c, x) do {                                 \
+  __m128d t_ = _mm_add_pd(s, x);                                \
+  __m128d z_ = _mm_sub_pd(t_, s);                               \
+  c = _mm_add_pd(c, _mm_add_pd(_mm_sub_pd(s, _mm_sub_pd(t_, z_)), \
+                               _mm_sub_pd(x, z_)));             \
+  s = t_;                                                       \
+} while (0)
+#endif
+
+/* convert array elements (or func results) to doubles; raises an
+   exception and returns NULL on error */
+static double*
+ary_unbox(strm_stream* strm, strm_value* v, strm_int len, strm_value func, int func_p)
+{
+  double* x = malloc(sizeof(double)*(len ? len : 1));
+  strm_int i;
+
+  if (!x) {
+    strm_raise(strm, "out of memory");
+    return NULL;
+  }
+  for (i=0; i<len; i++) {
+    strm_value val = v[i];
+
+    if (func_p) {
+      /* convert_number() has raised the error */
+      val = convert_number(strm, val, func);
+      if (strm_nil_p(val)) {
+        free(x);
+        return NULL;
+      }
+    }
+    else if (!strm_number_p(val)) {
+      free(x);
+      strm_raise(strm, "number required");
+      return NULL;
+    }
+    x[i] = strm_value_float(val);
+  }
+  return x;
+}
+
+/* compensated (Neumaier) sum */
+static double
+sum_kernel(const double* x, strm_int len)
+{
+  double s[KERNEL_LANES] = {0}, c[KERNEL_LANES] = {0};
+  double sum = 0, comp = 0;
+  strm_int i, j;
+
+#ifdef __SSE2__
+  {
+    __m128d s0 = _mm_setzero_pd(), s1 = s0, c0 = s0, c1 = s0;
+
+    for (i=0; i+KERNEL_LANES<=len; i+=KERNEL_LANES) {
+      __m128d x0 = _mm_loadu_pd(x+i);
+      __m128d x1 = _mm_loadu_pd(x+i+2);
+
+      TWOSUM_PD(s0, c0, x0);
+      TWOSUM_PD(s1, c1, x1);
+    }
+    _mm_storeu_pd(s, s0);
+    _mm_storeu_pd(s+2, s1);
+    _mm_storeu_pd(c, c0);
+    _mm_storeu_pd(c+2, c1);
+  }
+#else
+  for (i=0; i+KERNEL_LANES<=len; i+=KERNEL_LANES) {
+    for (j=0; j<KERNEL_LANES; j++) {
+      double t = s[j] + x[i+j];
+
+      if (fabs(s[j]) >= fabs(x[i+j]))
+        c[j] += ((s[j] - t) + x[i+j]);
+      else
+        c[j] += ((x[i+j] - t) + s[j]);
+      s[j] = t;
+    }
+  }
+#endif
+  for (; i<len; i++) {
+    double t = s[0] + x[i];
+
+    if (fabs(s[0]) >= fabs(x[i]))
+      c[0] += ((s[0] - t) + x[i]);
+    else
+      c[0] += ((x[i] - t) + s[0]);
+    s[0] = t;
+  }
+  for (j=0; j<KERNEL_LANES; j++) {
+    double t = sum + s[j];
+
+    if (fabs(sum) >= fabs(s[j]))
+      comp += ((sum - t) + s[j]);
+    else
+      comp += ((s[j] - t) + sum);
+    sum = t;
+    comp += c[j];
+  }
+  return sum + comp;
+}
+
+/* sum of squared deviations from mean (corrected two-pass) */
+static double
+ssd_kernel(const double* x, strm_int len, double mean)
+{
+  double s[KERNEL_LANES] = {0}, c[KERNEL_LANES] = {0};
+  double ss = 0, cs = 0;
+  strm_int i, j;
+
+#ifdef __SSE2__
+  {
+    const __m128d m = _mm_set1_pd(mean);
+    __m128d s0 = _mm_setzero_pd(), s1 = s0, c0 = s0, c1 = s0;
+
+    for (i=0; i+KERNEL_LANES<=len; i+=KERNEL_LANES) {
+      __m128d d0 = _mm_sub_pd(_mm_loadu_pd(x+i), m);
+      __m128d d1 = _mm_sub_pd(_mm_loadu_pd(x+i+2), m);
+
+      s0 = _mm_add_pd(s0, _mm_mul_pd(d0, d0));
+      s1 = _mm_add_pd(s1, _mm_mul_pd(d1, d1));
+      c0 = _mm_add_pd(c0, d0);
+      c1 = _mm_add_pd(c1, d1);
+    }
+    _mm_storeu_pd(s, s0);
+    _mm_storeu_pd(s+2, s1);
+    _mm_storeu_pd(c, c0);
+    _mm_storeu_pd(c+2, c1);
+  }
+#else
+  for (i=0; i+KERNEL_LANES<=len; i+=KERNEL_LANES) {
+    for (j=0; j<KERNEL_LANES; j++) {
+      double d = x[i+j] - mean;
+      s[j] += d * d;
+      c[j] += d;
+    }
+  }
+#endif
+  for (; i<len; i++) {
+    double d = x[i] - mean;
+    s[0] += d * d;
+    c[0] += d;
+  }
+  for (j=0; j<KERNEL_LANES; j++) {
+    ss += s[j];
+    cs += c[j];
+  }
+  return ss - cs * cs / len;
+}
+
+/* sum of products of deviations */
+static double
+spd_kernel(const double* x, const double* y, strm_int len, double mx, double my)
+{
+  double s[KERNEL_LANES] = {0};
+  double sum = 0;
+  strm_int i, j;
+
+#ifdef __SSE2__
+  {
+    const __m128d vx = _mm_set1_pd(mx), vy = _mm_set1_pd(my);
+    __m128d s0 = _mm_setzero_pd(), s1 = s0;
+
+    for (i=0; i+KERNEL_LANES<=len; i+=KERNEL_LANES) {
+      __m128d p0 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(x+i), vx),
+                              _mm_sub_pd(_mm_loadu_pd(y+i), vy));
+      __m128d p1 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(x+i+2), vx),
+                              _mm_sub_pd(_mm_loadu_pd(y+i+2), vy));
+
+      s0 = _mm_add_pd(s0, p0);
+      s1 = _mm_add_pd(s1, p1);
+    }
+    _mm_storeu_pd(s, s0);
+    _mm_storeu_pd(s+2, s1);
+  }
+#else
+  for (i=0; i+KERNEL_LANES<=len; i+=KERNEL_LANES) {
+    for (j=0; j<KERNEL_LANES; j++) {
+      s[j] += (x[i+j] - mx) * (y[i+j] - my);
+    }
+  }
+#endif
+  for (; i<len; i++) {
+    s[0] += (x[i] - mx) * (y[i] - my);
+  }
+  for (j=0; j<KERNEL_LANES; j++) {
+    sum += s[j];
+  }
+  return sum;
+}
+
 static int
 iter_sumf(strm_stream* strm, strm_value data)
 {
@@ -122,48 +325,17 @@ exec_avg(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 static int
 ary_sum_avg(strm_stream* strm, int argc, strm_value* args, strm_value* ret, int avg)
 {
-  int i, len;
+  strm_int len;
   strm_value* v;
-  double sum = 0;
-  double c = 0;
   strm_value func;
+  double* x;
+  double sum;
 
   strm_get_args(strm, argc, args, "a|v", &v, &len, &func);
-  if (argc == 1) {
-    for (i=0; i<len; i++) {
-      double x, t;
-
-      if (!strm_number_p(v[i])) {
-        return STRM_NG;
-      }
-      x = strm_value_float(v[i]);
-      t = sum + x;
-      if (fabs(sum) >= fabs(x))
-        c += ((sum - t) + x);
-      else
-        c += ((x - t) + sum);
-      sum =  t;
-    }
-  }
-  else {
-    for (i=0; i<len; i++) {
-      strm_value val;
-      double x, t;
-
-      val = convert_number(strm, v[i], func);
-      if (!strm_number_p(val)) {
-        return STRM_NG;
-      }
-      x = strm_value_float(val);
-      t = sum + x;
-      if (fabs(sum) >= fabs(x))
-        c += ((sum - t) + x);
-      else
-        c += ((x - t) + sum);
-      sum =  t;
-    }
-  }
-  sum += c;
+  x = ary_unbox(strm, v, len, func, argc > 1);
+  if (!x) return STRM_NG;
+  sum = sum_kernel(x, len);
+  free(x);
   if (avg) {
     *ret = strm_float_value(sum/len);
   }
@@ -185,88 +357,450 @@ ary_avg(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return ary_sum_avg(strm, argc, args, ret, TRUE);
 }
 
-struct mvavg_data {
-  strm_int num;
-  strm_int i;
-  strm_int filled;
+/* rolling window statistics; each record costs O(1) (amortized) */
+enum roll_mode {
+  roll_sum,
+  roll_mean,
+  roll_variance,
+  roll_stdev,
+  roll_min,
+  roll_max,
+};
+
+struct roll_entry {
+  double t;
+  double x;
+  uint64_t seq;
+};
+
+/* ring buffer of entries */
+struct roll_ring {
+  strm_int capa;
+  strm_int head;
+  strm_int len;
+  struct roll_entry* e;
+};
+
+#define ROLL_FIRST_CAPA 64
+#define roll_at(r,i) (&(r)->e[((r)->head+(i))%(r)->capa])
+#define roll_front(r) roll_at(r,0)
+#define roll_back(r) roll_at(r,(r)->len-1)
+
+static int
+roll_push(struct roll_ring* r, struct roll_entry* e)
+{
+  if (r->len == r->capa) {
+    strm_int capa = r->capa*2;
+    struct roll_entry* buf = malloc(sizeof(struct roll_entry)*capa);
+    strm_int i;
+
+    if (!buf) return STRM_NG;
+    for (i=0; i<r->len; i++) {
+      buf[i] = *roll_at(r, i);
+    }
+    free(r->e);
+    r->e = buf;
+    r->capa = capa;
+    r->head = 0;
+  }
+  *roll_at(r, r->len) = *e;
+  r->len++;
+  return STRM_OK;
+}
+
+static void
+roll_shift(struct roll_ring* r)
+{
+  r->head = (r->head+1)%r->capa;
+  r->len--;
+}
+
+struct rolling_data {
+  enum roll_mode mode;
+  strm_int num;                 /* count window (0 for time window) */
+  double period;                /* time window in seconds */
   strm_value func;
   strm_int func_p;
-  double data[0];
+  uint64_t seq;
+  struct roll_ring win;         /* values in the window */
+  struct roll_ring mono;        /* monotonic deque for min/max */
+  strm_int evicted;             /* evicted values since recalculation */
+  double sum, c;                /* compensated sum */
+  double mean, m2;              /* Welford's running variance */
 };
 
+static void
+roll_sum_add(struct rolling_data* d, double x)
+{
+  double t = d->sum + x;
+
+  if (fabs(d->sum) >= fabs(x))
+    d->c += ((d->sum - t) + x);
+  else
+    d->c += ((x - t) + d->sum);
+  d->sum = t;
+}
+
+static void
+roll_add(struct rolling_data* d, struct roll_entry* e)
+{
+  strm_int n = d->win.len;
+  double delta;
+
+  roll_sum_add(d, e->x);
+  delta = e->x - d->mean;
+  d->mean += delta / n;
+  d->m2 += delta * (e->x - d->mean);
+  if (d->mode == roll_min) {
+    while (d->mono.len > 0 && roll_back(&d->mono)->x > e->x) {
+      d->mono.len--;
+    }
+    roll_push(&d->mono, e);
+  }
+  else if (d->mode == roll_max) {
+    while (d->mono.len > 0 && roll_back(&d->mono)->x < e->x) {
+      d->mono.len--;
+    }
+    roll_push(&d->mono, e);
+  }
+}
+
+/* sums are recalculated once per window to cancel accumulated errors */
+static void
+roll_recalc(struct rolling_data* d)
+{
+  strm_int i, n = d->win.len;
+
+  d->sum = d->c = d->mean = d->m2 = 0;
+  for (i=0; i<n; i++) {
+    double x = roll_at(&d->win, i)->x;
+    double delta;
+
+    roll_sum_add(d, x);
+    delta = x - d->mean;
+    d->mean += delta / (i+1);
+    d->m2 += delta * (x - d->mean);
+  }
+  d->evicted = 0;
+}
+
+static void
+roll_remove(struct rolling_data* d)
+{
+  struct roll_entry* e = roll_front(&d->win);
+  strm_int n = d->win.len - 1;
+  double delta;
+
+  if (d->mono.len > 0 && roll_front(&d->mono)->seq == e->seq) {
+    roll_shift(&d->mono);
+  }
+  roll_shift(&d->win);
+  if (n == 0) {
+    d->sum = d->c = d->mean = d->m2 = 0;
+    return;
+  }
+  roll_sum_add(d, -e->x);
+  delta = e->x - d->mean;
+  d->mean -= delta / n;
+  d->m2 -= delta * (e->x - d->mean);
+  d->evicted++;
+}
+
 static int
-iter_mvavg(strm_stream* strm, strm_value data)
+iter_rolling(strm_stream* strm, strm_value data)
 {
-  struct mvavg_data* d = strm->data;
-  double sum = 0;
-  double c = 0;
-  strm_int i, len = d->num;
+  struct rolling_data* d = strm->data;
+  struct roll_entry e;
+  strm_int n;
+  double v;
 
   if (d->func_p) {
     data = convert_number(strm, data, d->func);
   }
+  e.t = 0;
+  if (d->num == 0) {            /* time window: [time, value] */
+    strm_value* p;
+
+    if (!strm_array_p(data) || strm_ary_len(data) != 2) {
+      strm_raise(strm, "time window requires [time, value]");
+      return STRM_NG;
+    }
+    p = strm_ary_ptr(data);
+    if (strm_time_p(p[0])) {
+      e.t = strm_time_float(p[0]);
+    }
+    else if (strm_number_p(p[0])) {
+      e.t = strm_value_float(p[0]);
+    }
+    else {
+      strm_raise(strm, "time window requires [time, value]");
+      return STRM_NG;
+    }
+    data = p[1];
+  }
   if (!strm_number_p(data)) {
     strm_raise(strm, "number required");
     return STRM_NG;
   }
-  d->data[d->i++] = strm_value_float(data);
-  if (d->i == d->num) {
-    d->filled = TRUE;
-    d->i = 0;
+  e.x = strm_value_float(data);
+  e.seq = d->seq++;
+
+  if (d->num > 0) {
+    if (d->win.len == d->num) {
+      roll_remove(d);
+    }
   }
-  if (!d->filled) {
+  else {
+    while (d->win.len > 0 && roll_front(&d->win)->t <= e.t - d->period) {
+      roll_remove(d);
+    }
+  }
+  if (d->evicted > 0 && d->evicted >= d->win.len) {
+    roll_recalc(d);
+  }
+  if (roll_push(&d->win, &e) == STRM_NG) return STRM_NG;
+  roll_add(d, &e);
+
+  n = d->win.len;
+  if (d->num > 0 && n < d->num) {
     strm_emit(strm, strm_nil_value(), NULL);
     return STRM_OK;
   }
-  for (i=0; i<len; i++) {
-    double x = d->data[i];
-    double t = sum + x;
-    if (fabs(sum) >= fabs(x))
-      c += ((sum - t) + x);
-    else
-      c += ((x - t) + sum);
-    sum =  t;
+  switch (d->mode) {
+  case roll_sum:
+    v = d->sum + d->c;
+    break;
+  case roll_mean:
+    v = (d->sum + d->c) / n;
+    break;
+  case roll_variance:
+    v = d->m2 / (n-1);
+    break;
+  case roll_stdev:
+    v = sqrt(d->m2 / (n-1));
+    break;
+  case roll_min:
+  case roll_max:
+  default:
+    v = roll_front(&d->mono)->x;
+    break;
   }
-  strm_emit(strm, strm_float_value((sum+c)/d->num), NULL);
+  strm_emit(strm, strm_float_value(v), NULL);
   return STRM_OK;
 }
 
 static int
-exec_mvavg(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+rolling_finish(strm_stream* strm, strm_value data)
 {
-  struct mvavg_data* d;
-  strm_int n;
+  struct rolling_data* d = strm->data;
+
+  free(d->win.e);
+  free(d->mono.e);
+  free(d);
+  return STRM_OK;
+}
+
+static int
+roll_ring_init(struct roll_ring* r, strm_int capa)
+{
+  r->capa = capa;
+  r->head = 0;
+  r->len = 0;
+  r->e = malloc(sizeof(struct roll_entry)*capa);
+  if (!r->e) return STRM_NG;
+  return STRM_OK;
+}
+
+/* rolling_xxx(n[, func]) for count window,
+   rolling_xxx(sec, "time"[, func]) for time window of [time, value] */
+static int
+exec_rolling(strm_stream* strm, int argc, strm_value* args, strm_value* ret, enum roll_mode mode)
+{
+  struct rolling_data* d;
+  strm_int n = 0;
+  double period = 0;
   strm_value func;
+  strm_int capa;
+
+  if (argc >= 2 && strm_string_p(args[1])) {
+    strm_string type;
 
-  strm_get_args(strm, argc, args, "i|v", &n, &func);
-  d = malloc(sizeof(struct mvavg_data)+n*sizeof(double));
+    strm_get_args(strm, argc, args, "fS|v", &period, &type, &func);
+    if (!strm_str_eq(type, strm_str_lit("time"))) {
+      strm_raise(strm, "unknown window type");
+      return STRM_NG;
+    }
+    if (period <= 0) {
+      strm_raise(strm, "invalid window size");
+      return STRM_NG;
+    }
+    capa = ROLL_FIRST_CAPA;
+  }
+  else {
+    strm_get_args(strm, argc, args, "i|v", &n, &func);
+    if (n <= 0) {
+      strm_raise(strm, "invalid window size");
+      return STRM_NG;
+    }
+    capa = n;
+  }
+  d = malloc(sizeof(struct rolling_data));
   if (!d) return STRM_NG;
+  d->mode = mode;
   d->num = n;
-  d->i = 0;
-  d->filled = FALSE;
-  if (argc == 1) {
-    d->func = strm_nil_value();
-    d->func_p = FALSE;
+  d->period = period;
+  d->func_p = (argc == 2 && n > 0) || argc == 3;
+  d->func = d->func_p ? func : strm_nil_value();
+  d->seq = 0;
+  d->evicted = 0;
+  d->sum = d->c = d->mean = d->m2 = 0;
+  if (roll_ring_init(&d->win, capa) == STRM_NG) {
+    free(d);
+    return STRM_NG;
   }
-  else {
-    d->func = func;
-    d->func_p = TRUE;
+  if (roll_ring_init(&d->mono, capa) == STRM_NG) {
+    free(d->win.e);
+    free(d);
+    return STRM_NG;
   }
-  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_mvavg,
-                                           NULL, (void*)d));
+  *ret = strm_stream_value(strm_stream_new(strm_filter, iter_rolling,
+                                           rolling_finish, (void*)d));
   return STRM_OK;
 }
 
+static int
+exec_mvavg(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_rolling(strm, argc, args, ret, roll_mean);
+}
+
+static int
+exec_rolling_sum(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_rolling(strm, argc, args, ret, roll_sum);
+}
+
+static int
+exec_rolling_var(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_rolling(strm, argc, args, ret, roll_variance);
+}
+
+static int
+exec_rolling_stdev(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_rolling(strm, argc, args, ret, roll_stdev);
+}
+
+static int
+exec_rolling_min(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_rolling(strm, argc, args, ret, roll_min);
+}
+
+static int
+exec_rolling_max(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_rolling(strm, argc, args, ret, roll_max);
+}
+
+/* one-pass moments (Welford, Pebay) and co-moments; partial results
+   from partitions (see parallel()) are combined by the merge functions */
+void
+strm_moments_add(struct strm_moments* m, double x)
+{
+  double n1 = m->n;
+  double n = n1 + 1;
+  double delta = x - m->mean;
+  double dn = delta / n;
+  double dn2 = dn * dn;
+  double t = delta * dn * n1;
+
+  m->mean += dn;
+  m->m4 += t * dn2 * (n*n - 3*n + 3) + 6 * dn2 * m->m2 - 4 * dn * m->m3;
+  m->m3 += t * dn * (n - 2) - 3 * dn * m->m2;
+  m->m2 += t;
+  m->n = n;
+}
+
+void
+strm_moments_merge(struct strm_moments* a, const struct strm_moments* b)
+{
+  double n = a->n + b->n;
+  double delta, d2, d3, d4;
+  double m2, m3, m4;
+
+  if (b->n == 0) return;
+  if (a->n == 0) {
+    *a = *b;
+    return;
+  }
+  delta = b->mean - a->mean;
+  d2 = delta * delta;
+  d3 = d2 * delta;
+  d4 = d2 * d2;
+  m2 = a->m2 + b->m2 + d2 * a->n * b->n / n;
+  m3 = a->m3 + b->m3 + d3 * a->n * b->n * (a->n - b->n) / (n * n)
+    + 3 * delta * (a->n * b->m2 - b->n * a->m2) / n;
+  m4 = a->m4 + b->m4
+    + d4 * a->n * b->n * (a->n * a->n - a->n * b->n + b->n * b->n) / (n * n * n)
+    + 6 * d2 * (a->n * a->n * b->m2 + b->n * b->n * a->m2) / (n * n)
+    + 4 * delta * (a->n * b->m3 - b->n * a->m3) / n;
+  a->mean += delta * b->n / n;
+  a->m2 = m2;
+  a->m3 = m3;
+  a->m4 = m4;
+  a->n = n;
+}
+
+void
+strm_comoments_add(struct strm_comoments* m, double x, double y)
+{
+  double n = m->n + 1;
+  double dx = x - m->mx;
+  double dy = y - m->my;
+
+  m->mx += dx / n;
+  m->my += dy / n;
+  m->sxx += dx * (x - m->mx);
+  m->syy += dy * (y - m->my);
+  m->sxy += dx * (y - m->my);
+  m->n = n;
+}
+
+void
+strm_comoments_merge(struct strm_comoments* a, const struct strm_comoments* b)
+{
+  double n = a->n + b->n;
+  double dx, dy, f;
+
+  if (b->n == 0) return;
+  if (a->n == 0) {
+    *a = *b;
+    return;
+  }
+  dx = b->mx - a->mx;
+  dy = b->my - a->my;
+  f = a->n * b->n / n;
+  a->sxx += b->sxx + dx * dx * f;
+  a->syy += b->syy + dy * dy * f;
+  a->sxy += b->sxy + dx * dy * f;
+  a->mx += dx * b->n / n;
+  a->my += dy * b->n / n;
+  a->n = n;
+}
+
 enum stdev_mode {
   mode_stdev,
   mode_variance,
   mode_mean_stdev,
   mode_mean_variance,
+  mode_skewness,
+  mode_kurtosis,
 };
 
 struct stdev_data {
-  strm_int num;
-  double s1, s2;
+  struct strm_moments m;
   strm_value func;
   enum stdev_mode mode;
 };
@@ -275,12 +809,12 @@ static int
 iter_stdev(strm_stream* strm, strm_value data)
 {
   struct stdev_data* d = strm->data;
-  double x = strm_value_float(data);
 
-  d->num++;
-  x -= d->s1;
-  d->s1 += x/d->num;
-  d->s2 += (d->num-1) * x * x / d->num;
+  if (!strm_number_p(data)) {
+    strm_raise(strm, "number required");
+    return STRM_NG;
+  }
+  strm_moments_add(&d->m, strm_value_float(data));
   return STRM_OK;
 }
 
@@ -288,17 +822,12 @@ static int
 iter_stdevf(strm_stream* strm, strm_value data)
 {
   struct stdev_data* d = strm->data;
-  double x;
 
   data = convert_number(strm, data, d->func);
   if (!strm_number_p(data)) {
     return STRM_NG;
   }
-  x = strm_value_float(data);
-  d->num++;
-  x -= d->s1;
-  d->s1 += x/d->num;
-  d->s2 += (d->num-1) * x * x / d->num;
+  strm_moments_add(&d->m, strm_value_float(data));
   return STRM_OK;
 }
 
@@ -307,7 +836,6 @@ float2(double m, double s)
 {
   strm_value buf[2];
 
-  fprintf(stderr, "f2[%f, %f]\n", m, s);
   buf[0] = strm_float_value(m);
   buf[1] = strm_float_value(s);
   return strm_ary_new(buf, 2);
@@ -317,29 +845,68 @@ static int
 stdev_finish(strm_stream* strm, strm_value data)
 {
   struct stdev_data* d = strm->data;
+  struct strm_moments* m = &d->m;
   double s;
 
   switch (d->mode) {
   case mode_stdev:
-    s = sqrt(d->s2 / (d->num-1));
+    s = sqrt(m->m2 / (m->n-1));
     strm_emit(strm, strm_float_value(s), NULL);
     break;
   case mode_variance:
-    s = d->s2 / (d->num-1);
+    s = m->m2 / (m->n-1);
     strm_emit(strm, strm_float_value(s), NULL);
     break;
   case mode_mean_stdev:
-    s = sqrt(d->s2 / (d->num-1));
-    strm_emit(strm, float2(d->s1, s), NULL);
+    s = sqrt(m->m2 / (m->n-1));
+    strm_emit(strm, float2(m->mean, s), NULL);
     break;
   case mode_mean_variance:
-    s = d->s2 / (d->num-1);
-    strm_emit(strm, float2(d->s1, s), NULL);
+    s = m->m2 / (m->n-1);
+    strm_emit(strm, float2(m->mean, s), NULL);
+    break;
+  case mode_skewness:
+    s = sqrt(m->n) * m->m3 / pow(m->m2, 1.5);
+    strm_emit(strm, strm_float_value(s), NULL);
+    break;
+  case mode_kurtosis:           /* excess kurtosis */
+    s = m->n * m->m4 / (m->m2 * m->m2) - 3;
+    strm_emit(strm, strm_float_value(s), NULL);
     break;
   }
+  free(d);
   return STRM_OK;
 }
 
+static void*
+stdev_clone(void* data)
+{
+  struct stdev_data* d = malloc(sizeof(struct stdev_data));
+
+  if (!d) return NULL;
+  *d = *(struct stdev_data*)data;
+  memset(&d->m, 0, sizeof(d->m));
+  return d;
+}
+
+static void
+stdev_merge(void* data, void* part)
+{
+  struct stdev_data* d = data;
+  struct stdev_data* p = part;
+
+  strm_moments_merge(&d->m, &p->m);
+  free(p);
+}
+
+static const struct strm_merger stdev_merger = {
+  iter_stdev, stdev_clone, stdev_merge,
+};
+
+static const struct strm_merger stdevf_merger = {
+  iter_stdevf, stdev_clone, stdev_merge,
+};
+
 static int
 exec_var_stdev(strm_stream* strm, int argc, strm_value* args, strm_value* ret, enum stdev_mode mode)
 {
@@ -349,8 +916,7 @@ exec_var_stdev(strm_stream* strm, int argc, strm_value* args, strm_value* ret, e
   strm_get_args(strm, argc, args, "|v", &func);
   d = malloc(sizeof(struct stdev_data));
   if (!d) return STRM_NG;
-  d->num = 0;
-  d->s1 = d->s2 = 0.0;
+  memset(&d->m, 0, sizeof(d->m));
   d->mode = mode;
   if (argc == 0) {
     *ret = strm_stream_value(strm_stream_new(strm_filter, iter_stdev, stdev_finish, (void*)d));
@@ -386,41 +952,33 @@ exec_mean_variance(strm_stream* strm, int argc, strm_value* args, strm_value* re
   return exec_var_stdev(strm, argc, args, ret, mode_mean_variance);
 }
 
+static int
+exec_skewness(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_var_stdev(strm, argc, args, ret, mode_skewness);
+}
+
+static int
+exec_kurtosis(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_var_stdev(strm, argc, args, ret, mode_kurtosis);
+}
+
 static int
 ary_var_stdev(strm_stream* strm, int argc, strm_value* args, strm_value* ret, int stdev)
 {
   strm_value func;
   strm_value* v;
-  int i, len;
-  double s1, s2;
+  strm_int len;
+  double* x;
+  double s2;
 
   strm_get_args(strm, argc, args, "a|v", &v, &len, &func);
-
-  s1 = s2 = 0.0;
-  if (argc == 0) {
-    for (i=0; i<len; i++) {
-      double x = strm_value_float(v[i]);
-      x -= s1;
-      s1 += x/(i+1);
-      s2 += i * x * x / (i+1);
-    }
-  }
-  else {
-    for (i=0; i<len; i++) {
-      strm_value val;
-      double x;
-
-      val = convert_number(strm, v[i], func);
-      if (!strm_number_p(val)) {
-        return STRM_NG;
-      }
-      x = strm_value_float(val);
-      x -= s1;
-      s1 += x/(i+1);
-      s2 += i * x * x / (i+1);
-    }
-  }
-  s2 = s2 / (i-1);
+  x = ary_unbox(strm, v, len, func, argc > 1);
+  if (!x) return STRM_NG;
+  s2 = ssd_kernel(x, len, sum_kernel(x, len)/len);
+  free(x);
+  s2 = s2 / (len-1);
   if (stdev) {
     s2 = sqrt(s2);
   }
@@ -440,9 +998,15 @@ ary_var(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return ary_var_stdev(strm, argc, args, ret, FALSE);
 }
 
+enum correl_mode {
+  mode_correl,
+  mode_covariance,
+  mode_linear_regression,
+};
+
 struct correl_data {
-  strm_int n;
-  double sx, sy, sxx, syy, sxy;
+  struct strm_comoments m;
+  enum correl_mode mode;
 };
 
 static int
@@ -450,7 +1014,6 @@ iter_correl(strm_stream* strm, strm_value data)
 {
   struct correl_data* d = strm->data;
   strm_value *v;
-  double dx, dy;
 
   if (!strm_array_p(data) || strm_ary_len(data) != 2) {
     strm_raise(strm, "invalid data");
@@ -459,15 +1022,10 @@ iter_correl(strm_stream* strm, strm_value data)
 
   v = strm_ary_ptr(data);
   if (!strm_number_p(v[0]) || !strm_number_p(v[1])) {
-    strm_raise(strm, "correl() requires [num, num]");
+    strm_raise(strm, "[num, num] required");
     return STRM_NG;
   }
-  d->n++;
-  dx = strm_value_float(v[0]) - d->sx; d->sx += dx / d->n;
-  dy = strm_value_float(v[1]) - d->sy; d->sy += dy / d->n;
-  d->sxx += (d->n-1) * dx * dx / d->n;
-  d->syy += (d->n-1) * dy * dy / d->n;
-  d->sxy += (d->n-1) * dx * dy / d->n;
+  strm_comoments_add(&d->m, strm_value_float(v[0]), strm_value_float(v[1]));
   return STRM_OK;
 }
 
@@ -475,58 +1033,121 @@ static int
 correl_finish(strm_stream* strm, strm_value data)
 {
   struct correl_data* d = strm->data;
+  struct strm_comoments* m = &d->m;
 
-  d->n--;
-  double sxx = sqrt(d->sxx / d->n);
-  double syy = sqrt(d->syy / d->n);
-  double sxy = d->sxy / (d->n * sxx * syy);
-  strm_emit(strm, strm_float_value(sxy), NULL);
+  switch (d->mode) {
+  case mode_correl:
+    strm_emit(strm, strm_float_value(m->sxy / sqrt(m->sxx * m->syy)), NULL);
+    break;
+  case mode_covariance:
+    strm_emit(strm, strm_float_value(m->sxy / (m->n-1)), NULL);
+    break;
+  case mode_linear_regression:  /* [slope, intercept] of y = a*x + b */
+    {
+      double a = m->sxy / m->sxx;
+      strm_emit(strm, float2(a, m->my - a * m->mx), NULL);
+    }
+    break;
+  }
+  free(d);
   return STRM_OK;
 }
 
+static void*
+correl_clone(void* data)
+{
+  struct correl_data* d = malloc(sizeof(struct correl_data));
+
+  if (!d) return NULL;
+  *d = *(struct correl_data*)data;
+  memset(&d->m, 0, sizeof(d->m));
+  return d;
+}
+
+static void
+correl_merge(void* data, void* part)
+{
+  struct correl_data* d = data;
+  struct correl_data* p = part;
+
+  strm_comoments_merge(&d->m, &p->m);
+  free(p);
+}
+
+static const struct strm_merger correl_merger = {
+  iter_correl, correl_clone, correl_merge,
+};
+
 static int
-exec_correl(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+exec_correl_mode(strm_stream* strm, int argc, strm_value* args, strm_value* ret, enum correl_mode mode)
 {
   struct correl_data* d;
 
   strm_get_args(strm, argc, args, "");
   d = malloc(sizeof(struct correl_data));
   if (!d) return STRM_NG;
-  d->n = 0;
-  d->sx = d->sy = d->sxx = d->syy = d->sxy = 0;
+  memset(&d->m, 0, sizeof(d->m));
+  d->mode = mode;
   *ret = strm_stream_value(strm_stream_new(strm_filter, iter_correl,
                                            correl_finish, (void*)d));
   return STRM_OK;
 }
 
+static int
+exec_correl(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_correl_mode(strm, argc, args, ret, mode_correl);
+}
+
+static int
+exec_covariance(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_correl_mode(strm, argc, args, ret, mode_covariance);
+}
+
+static int
+exec_linreg(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
+{
+  return exec_correl_mode(strm, argc, args, ret, mode_linear_regression);
+}
+
 static int
 ary_correl(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 {
   strm_value* v;
-  int i, len;
-  double sx, sy, sxx, syy, sxy;
+  strm_int i, n, len;
+  double *x, *y;
+  double mx, my, sxx, syy, sxy;
 
   strm_get_args(strm, argc, args, "a", &v, &len);
-  sx = sy = sxx = syy = sxy = 0;
-  for (i=0; i<len; i++) {
+  x = malloc(sizeof(double)*(len ? len*2 : 1));
+  if (!x) {
+    strm_raise(strm, "out of memory");
+    return STRM_NG;
+  }
+  y = x + len;
+  for (i=0,n=0; i<len; i++) {
     strm_value data = v[i];
     strm_value* dv;
-    double dx, dy;
 
     if (!strm_array_p(data) || strm_ary_len(data) != 2) {
       /* skip invalid data */
       continue;
     }
     dv = strm_ary_ptr(data);
-    dx = strm_value_float(dv[0]) - sx; sx += dx / (i+1);
-    dy = strm_value_float(dv[1]) - sy; sy += dy / (i+1);
-    sxx += i * dx * dx / (i+1);
-    syy += i * dy * dy / (i+1);
-    sxy += i * dx * dy / (i+1);
-  }
-  sxx = sqrt(sxx / (len-1));
-  syy = sqrt(syy / (len-1));
-  sxy /= (len-1) * sxx * syy;
+    if (!strm_number_p(dv[0]) || !strm_number_p(dv[1])) {
+      continue;
+    }
+    x[n] = strm_value_float(dv[0]);
+    y[n] = strm_value_float(dv[1]);
+    n++;
+  }
+  mx = sum_kernel(x, n)/n;
+  my = sum_kernel(y, n)/n;
+  sxx = sqrt(ssd_kernel(x, n, mx) / (n-1));
+  syy = sqrt(ssd_kernel(y, n, my) / (n-1));
+  sxy = spd_kernel(x, y, n, mx, my) / ((n-1) * sxx * syy);
+  free(x);
   *ret = strm_float_value(sxy);
   return STRM_OK;
 }
@@ -539,11 +1160,23 @@ strm_stat_init(strm_state* state)
   strm_var_def(state, "mean", strm_cfunc_value(exec_avg));
   strm_var_def(state, "moving_average", strm_cfunc_value(exec_mvavg));
   strm_var_def(state, "rolling_mean", strm_cfunc_value(exec_mvavg));
+  strm_var_def(state, "rolling_sum", strm_cfunc_value(exec_rolling_sum));
+  strm_var_def(state, "rolling_variance", strm_cfunc_value(exec_rolling_var));
+  strm_var_def(state, "rolling_stdev", strm_cfunc_value(exec_rolling_stdev));
+  strm_var_def(state, "rolling_min", strm_cfunc_value(exec_rolling_min));
+  strm_var_def(state, "rolling_max", strm_cfunc_value(exec_rolling_max));
   strm_var_def(state, "stdev", strm_cfunc_value(exec_stdev));
   strm_var_def(state, "variance", strm_cfunc_value(exec_variance));
   strm_var_def(state, "mean_stdev", strm_cfunc_value(exec_mean_stdev));
   strm_var_def(state, "mean_variance", strm_cfunc_value(exec_mean_variance));
   strm_var_def(state, "correl", strm_cfunc_value(exec_correl));
+  strm_var_def(state, "covariance", strm_cfunc_value(exec_covariance));
+  strm_var_def(state, "skewness", strm_cfunc_value(exec_skewness));
+  strm_var_def(state, "kurtosis", strm_cfunc_value(exec_kurtosis));
+  strm_var_def(state, "linear_regression", strm_cfunc_value(exec_linreg));
+  strm_merger_def(&stdev_merger);
+  strm_merger_def(&stdevf_merger);
+  strm_merger_def(&correl_merger);
 
   strm_var_def(strm_ns_array, "sum", strm_cfunc_value(ary_sum));
   strm_var_def(strm_ns_array, "average", strm_cfunc_value(ary_avg));
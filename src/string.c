@@ -65,6 +65,9 @@ static pthread_mutex_t sym_mutex = PTHREAD_MUTEX_INITIALIZER;
 static khash_t(sym) *sym_table;
 
 
+/* flags of struct strm_string */
+#define STR_INTERNED 1          /* registered in sym_table */
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 # define VALP_PTR(p) ((char*)p)
 #else
@@ -119,6 +122,7 @@ str_new(const char* p, strm_int len, int foreign)
       str->ptr = buf;
     }
     str->len = len;
+    str->flags = 0;
     val = strm_tag_vptr(str, 0);
   }
   return tag | (val & STRM_VAL_MASK);
@@ -146,6 +150,7 @@ str_intern(const char *p, strm_int len, int foreign)
     return kh_value(sym_table, k);
   }
   str = str_new(p, len, foreign);
+  ((struct strm_string*)strm_value_vptr(str))->flags |= STR_INTERNED;
   kh_key(sym_table, k).ptr = strm_str_ptr(str);
   kh_value(sym_table, k) = str;
 
@@ -174,6 +179,37 @@ strm_str_static(const char* p, strm_int len)
   return str_new(p, len, 1);
 }
 
+/* headers of slice strings are taken from per-thread blocks, so that
+   making a slice does not call malloc() for each string */
+#ifndef STRM_STR_SLICE_BLOCK
+#define STRM_STR_SLICE_BLOCK 1024
+#endif
+
+static __thread struct strm_string* slice_hdr;
+static __thread int slice_left = 0;
+
+/* string pointing to p without copying; p[len] must be readable */
+strm_string
+strm_str_slice(const char* p, strm_int len)
+{
+  struct strm_string* str;
+
+  if (len <= 6) {
+    return str_new(p, len, 1);
+  }
+  if (slice_left == 0) {
+    slice_hdr = malloc(sizeof(struct strm_string)*STRM_STR_SLICE_BLOCK);
+    if (!slice_hdr) return str_new(p, len, 0);
+    slice_left = STRM_STR_SLICE_BLOCK;
+  }
+  str = slice_hdr++;
+  slice_left--;
+  str->ptr = p;
+  str->len = len;
+  str->flags = 0;
+  return STRM_TAG_STRING_F | (strm_tag_vptr(str, 0) & STRM_VAL_MASK);
+}
+
 strm_string
 strm_str_intern(const char* p, strm_int len)
 {
@@ -218,9 +254,13 @@ strm_str_intern_p(strm_string s)
   switch (strm_value_tag(s)) {
   case STRM_TAG_STRING_I:
   case STRM_TAG_STRING_6:
-  case STRM_TAG_STRING_F:
     return TRUE;
   case STRM_TAG_STRING_O:
+  case STRM_TAG_STRING_F:
+    {
+      struct strm_string* str = (struct strm_string*)strm_value_vptr(s);
+      return (str->flags & STR_INTERNED) != 0;
+    }
   default:
     return FALSE;
   }
@@ -230,8 +270,7 @@ int
 strm_str_eq(strm_string a, strm_string b)
 {
   if (a == b) return TRUE;
-  if (strm_value_tag(a) == STRM_TAG_STRING_F &&
-      strm_value_tag(b) == STRM_TAG_STRING_F) {
+  if (strm_str_intern_p(a) && strm_str_intern_p(b)) {
     /* pointer comparison is OK if strings are interned */
     return FALSE;
   }
@@ -290,11 +329,25 @@ strm_str_cstr(strm_string s, char buf[])
     buf[6] = '\0';
     return buf;
   case STRM_TAG_STRING_O:
-  case STRM_TAG_STRING_F:
     {
       struct strm_string* str = (struct strm_string*)strm_value_vptr(s);
       return str->ptr;
     }
+  case STRM_TAG_STRING_F:
+    {
+      struct strm_string* str = (struct strm_string*)strm_value_vptr(s);
+      char* p;
+
+      if (str->ptr[str->len] == '\0') return str->ptr;
+      /* slice string, which may be in a read-only mapping; give it
+         a terminated copy once, so later calls return the copy */
+      p = malloc(str->len+1);
+      if (!p) return NULL;
+      memcpy(p, str->ptr, str->len);
+      p[str->len] = '\0';
+      __atomic_store_n(&str->ptr, p, __ATOMIC_RELEASE);
+      return p;
+    }
   default:
     return NULL;
   }
@@ -68,6 +68,7 @@ int strm_value_bool(strm_value);
 double strm_value_float(strm_value);
 
 int strm_value_eq(strm_value, strm_value);
+uint64_t strm_value_hash(strm_value);
 int strm_nil_p(strm_value);
 int strm_bool_p(strm_value);
 int strm_number_p(strm_value);
@@ -105,12 +106,14 @@ void* strm_value_foreign(strm_value);
 struct strm_string {
   const char *ptr;
   strm_int len;
+  strm_int flags;
 };
 
 typedef uint64_t strm_string;
 
 strm_string strm_str_new(const char*, strm_int);
 strm_string strm_str_static(const char*, strm_int);
+strm_string strm_str_slice(const char*, strm_int);
 #define strm_strlen_lit(s) (sizeof(s "") - 1)
 #define strm_str_lit(s) strm_str_static(s, strm_strlen_lit(s))
 
@@ -189,7 +192,11 @@ void strm_io_emit(strm_stream* strm, strm_value data, int fd, strm_callback cb);
 int strm_stream_connect(strm_stream* src, strm_stream* dst);
 int strm_connect(strm_stream* strm, strm_value src, strm_value dst, strm_value* ret);
 int strm_loop();
+int strm_worker_count();
 void strm_stream_close(strm_stream* strm);
+void strm_stream_detach(strm_stream* strm);
+int strm_chan_p(strm_stream* strm);
+void strm_chan_subscribe(strm_stream* chan, strm_stream* dst);
 #define strm_stream_p(v) strm_ptr_tag_p(v, STRM_PTR_STREAM)
 
 extern int strm_event_loop_started;
@@ -228,12 +235,15 @@ typedef struct strm_state {
 #define STRM_NS_UDEF_GET(ns)  ((ns)->flags & STRM_NS_UDEF)
 #define STRM_NS_ALLOC_ERR(ns) ((ns) == NULL)
 #define STRM_NS_EXIST_ERR(ns) ((ns) == (void*)-1)
+/* env may be referred from closures (cannot be reused) */
+#define STRM_STATE_CAPTURED 2
 
 int strm_var_set(strm_state*, strm_string, strm_value);
 int strm_var_def(strm_state*, const char*, strm_value);
 int strm_var_get(strm_state*, strm_string, strm_value*);
 int strm_var_match(strm_state*, strm_string, strm_value);
 int strm_env_copy(strm_state*, strm_state*);
+void strm_env_clear(strm_state*);
 
 /* ----- Namespaces */
 strm_state* strm_ns_new(strm_state*, const char*);
@@ -251,6 +261,7 @@ extern strm_state* strm_ns_number;
 #define STRM_IO_WRITE 2
 #define STRM_IO_FLUSH 4
 #define STRM_IO_READING 8
+#define STRM_IO_WRITING 16
 
 typedef struct strm_io {
   STRM_PTR_HEADER;
@@ -262,7 +273,11 @@ typedef struct strm_io {
 
 strm_value strm_io_new(int fd, int mode);
 strm_stream* strm_io_stream(strm_value io, int mode);
+strm_stream* strm_readio_parallel(int fd, strm_int n, int ordered);
 void strm_io_start_read(strm_stream* strm, int fd, strm_callback cb);
+void strm_io_kick(strm_stream* strm, int fd, strm_callback cb);
+int strm_io_thread_count();
+void strm_io_set_thread(strm_stream* strm, int n);
 #define strm_value_io(v) (strm_io)strm_value_ptr(v, STRM_PTR_IO)
 #define strm_io_p(v) strm_ptr_tag_p(v, STRM_PTR_IO)
 
@@ -286,8 +301,33 @@ struct strm_genfunc {
 /* ----- time */
 int strm_time_p(strm_value);
 strm_value strm_time_new(long sec, long usec, int offset);
+double strm_time_float(strm_value);
+int strm_time_offset(strm_value);
 int strm_time_parse_time(const char* s, strm_int len, long* sec, long* usec, int* offset);
 
+/* ----- statistics */
+struct strm_moments {
+  double n, mean, m2, m3, m4;
+};
+
+struct strm_comoments {
+  double n, mx, my, sxx, syy, sxy;
+};
+
+void strm_moments_add(struct strm_moments*, double);
+void strm_moments_merge(struct strm_moments*, const struct strm_moments*);
+void strm_comoments_add(struct strm_comoments*, double, double);
+void strm_comoments_merge(struct strm_comoments*, const struct strm_comoments*);
+
+/* ----- parallel aggregation */
+struct strm_merger {
+  strm_callback start;          /* iter function of the stage */
+  void* (*clone)(void*);        /* empty state with the same parameters */
+  void (*merge)(void*, void*);  /* merge the latter state into the former, and free it */
+};
+
+void strm_merger_def(const struct strm_merger*);
+
 /* ----- signal */
 typedef void (*strm_sighandler_t)(int, void*);
 int strm_signal(int sig, strm_sighandler_t func, void* arg);
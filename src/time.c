@@ -545,6 +545,24 @@ time_str(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
   return STRM_OK;
 }
 
+/* seconds from the epoch */
+double
+strm_time_float(strm_value v)
+{
+  struct strm_time *t = get_time(v);
+
+  return timeval_to_num(&t->tv);
+}
+
+/* offset from UTC in minutes */
+int
+strm_time_offset(strm_value v)
+{
+  struct strm_time *t = get_time(v);
+
+  return t->utc_offset;
+}
+
 static int
 time_num(strm_stream* strm, int argc, strm_value* args, strm_value* ret)
 {
@@ -234,10 +234,65 @@ strm_value_eq(strm_value a, strm_value b)
     if (strm_number_p(a) && strm_number_p(b)) {
       return strm_value_float(a) == strm_value_float(b);
     }
+    /* owned and foreign (e.g. slices of input) strings */
+    if (strm_string_p(a) && strm_string_p(b)) {
+      return strm_str_eq(a, b);
+    }
     return FALSE;
   }
 }
 
+static inline uint64_t
+fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/* hash of a value: strings by content, numbers by value (so that 1 and
+   1.0 are same), arrays by elements, others by identity */
+uint64_t
+strm_value_hash(strm_value v)
+{
+  if (strm_string_p(v)) {
+    strm_string str = strm_value_str(v);
+    const unsigned char* p = (const unsigned char*)strm_str_ptr(str);
+    strm_int i, len = strm_str_len(str);
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+    for (i=0; i<len; i++) {
+      h ^= p[i];
+      h *= 0x100000001b3ULL;
+    }
+    return fmix64(h);
+  }
+  if (strm_number_p(v)) {
+    union {
+      double f;
+      uint64_t i;
+    } u;
+
+    u.f = strm_value_float(v);
+    if (u.f == 0) u.f = 0;      /* -0.0 */
+    return fmix64(u.i);
+  }
+  if (strm_array_p(v)) {
+    strm_value* p = strm_ary_ptr(v);
+    strm_int i, len = strm_ary_len(v);
+    uint64_t h = fmix64(len);
+
+    for (i=0; i<len; i++) {
+      h = fmix64(h ^ strm_value_hash(p[i]));
+    }
+    return h;
+  }
+  return fmix64(v);
+}
+
 static int
 str_symbol_p(strm_string str)
 {